@@ -18,6 +18,7 @@
 #include <linux/init.h>
 #include <linux/if_ether.h>
 #include <net/ip.h>
+#include <net/icmp.h>
 #include <linux/random.h>
 #include <linux/wireless.h>
 
@@ -68,6 +69,43 @@ static struct packet_type dsr_packet_type = {
 	.func = dsr_dev_llrecv,
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+#define DSR_JITTER_QUEUE
+#endif
+
+/* From 2.6.27 on, dsr0 takes scatter-gather skbs with offloaded checksums,
+ * so the stack does not linearize bulk data for us and GSO segments late,
+ * just before dsr_dev_start_xmit(). The DSR header is inserted in the
+ * headroom, which is made large enough for the options of most routes. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+#define DSR_SG_XMIT
+#define DSR_OPTS_HEADROOM 64
+#endif
+
+#ifdef DSR_JITTER_QUEUE
+/* Packets flagged with PKT_XMIT_JITTER (RREQs, RREPs, ACKs) are held back
+ * for a random time of up to BroadCastJitter so that neighbors that
+ * rebroadcast the same packet do not all transmit at once. The queue is
+ * sorted on release time. An hrtimer fires at the earliest release time
+ * and schedules a tasklet that sends all packets that are due in one
+ * batch. On older kernels the packets are sent right away. */
+#define JITTER_QUEUE_MAX_LEN 64
+#define JITTER_BATCH_MAX 16
+#define JITTER_SLACK_NSECS 100000
+
+struct jitter_cb {
+	s64 release;		/* Monotonic time in nsecs */
+};
+
+#define JITTER_CB(skb) ((struct jitter_cb *)&((skb)->cb[0]))
+
+static struct sk_buff_head jitter_queue;
+static struct hrtimer jitter_timer;
+static struct tasklet_struct jitter_tasklet;
+
+static void dsr_jitter_purge(void);
+#endif
+
 struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 {
 	struct sk_buff *skb;
@@ -82,6 +120,7 @@ struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 
 	LOG_DBG("ip_len=%d dsr_opts_len=%d payload_len=%d tot_len=%d\n",
 	      ip_len, dsr_opts_len, dp->payload_len, tot_len);
+
 #ifdef KERNEL26
 	skb = alloc_skb(tot_len + LL_RESERVED_SPACE(dev), GFP_ATOMIC);
 #else
@@ -123,9 +162,102 @@ struct sk_buff *dsr_skb_create(struct dsr_pkt *dp, struct net_device *dev)
 		buf += dsr_opts_len;
 	}
 
-	/* Add payload */
-	if (dp->payload_len && dp->payload)
-		memcpy(buf, dp->payload, dp->payload_len);
+	/* Add payload. Buffered packets share the pages of the original, so
+	 * the payload may be in fragments. */
+	if (dp->payload_len && dp->payload) {
+		if (dp->skb && skb_is_nonlinear(dp->skb)) {
+			if (skb_copy_bits(dp->skb,
+					  dp->payload - (char *)dp->skb->data,
+					  buf, dp->payload_len) < 0) {
+				LOG_DBG("Could not copy payload\n");
+				kfree_skb(skb);
+				return NULL;
+			}
+		} else
+			memcpy(buf, dp->payload, dp->payload_len);
+	}
+
+	return skb;
+}
+
+/* Reuse the skb a packet came in, from the slave or from the stack on dsr0,
+ * for sending or delivering it. The payload stays where it is, possibly in
+ * page fragments, and the IP header and DSR options, if any, are written in
+ * front of it, so only the headers are copied. Returns NULL if the skb
+ * cannot be used, in which case dsr_skb_create() has to copy the packet. */
+static struct sk_buff *dsr_skb_reuse(struct dsr_pkt *dp, struct net_device *dev)
+{
+	struct sk_buff *skb = dp->skb;
+	int ip_len, hdr_len, payload_off, headroom;
+	char *buf;
+
+	if (!skb || !dp->payload || skb_shared(skb))
+		return NULL;
+
+	/* The headers have to be in the linear part, the payload can be
+	 * anywhere */
+	payload_off = dp->payload - (char *)skb->data;
+
+	if (payload_off < 0 || payload_off > (int)skb_headlen(skb) ||
+	    payload_off + dp->payload_len > skb->len)
+		return NULL;
+
+	ip_len = dp->nh.iph->ihl << 2;
+	hdr_len = ip_len + dsr_pkt_opts_len(dp);
+
+	/* The IP header may point into the skb, which is about to be
+	 * overwritten or reallocated */
+	if (dp->nh.raw != dp->ip_data) {
+		memcpy(dp->ip_data, dp->nh.raw, ip_len);
+		dp->nh.raw = dp->ip_data;
+	}
+
+	/* Only grow the head when the options did, e.g., after adding an ACK
+	 * REQ */
+	headroom = hdr_len + LL_RESERVED_SPACE(dev) -
+		(skb_headroom(skb) + payload_off);
+
+	if (headroom < 0)
+		headroom = 0;
+
+	if (headroom || skb_cloned(skb)) {
+		if (pskb_expand_head(skb, headroom, 0, GFP_ATOMIC)) {
+			LOG_DBG("Could not expand skb head\n");
+			return NULL;
+		}
+		dp->payload = (char *)skb->data + payload_off;
+	}
+
+	/* Drop link layer padding */
+	if (skb->len > payload_off + dp->payload_len &&
+	    pskb_trim(skb, payload_off + dp->payload_len))
+		return NULL;
+
+	skb_pull(skb, payload_off);
+
+	buf = skb_push(skb, hdr_len);
+
+	SKB_SET_NETWORK_HDR(skb, 0);
+	SKB_SET_MAC_HDR(skb, -ETH_HLEN);
+
+	memcpy(buf, dp->nh.raw, ip_len);
+	memcpy(buf + ip_len, dp->dh.raw, dsr_pkt_opts_len(dp));
+
+	ip_send_check((struct iphdr *)buf);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,31)
+	dst_release(skb->dst);
+	skb->dst = NULL;
+#else
+	skb_dst_drop(skb);
+#endif
+	skb->dev = dev;
+	skb->protocol = htons(ETH_P_IP);
+	skb->ip_summed = CHECKSUM_NONE;
+
+	/* The skb is ours now */
+	dp->skb = NULL;
+	dp->payload = NULL;
 
 	return skb;
 }
@@ -136,12 +268,17 @@ int dsr_hw_header_create(struct dsr_pkt *dp, struct sk_buff *skb)
 	struct sockaddr broadcast =
 	    { AF_UNSPEC, {0xff, 0xff, 0xff, 0xff, 0xff, 0xff} };
 	struct neighbor_info neigh_info;
+	int hh_len;
 
 	if (dp->dst.s_addr == DSR_BROADCAST)
 		memcpy(neigh_info.hw_addr.sa_data, broadcast.sa_data, ETH_ALEN);
 	else {
+		/* Use the neighbor's prebuilt header if there is one */
+		if (neigh_tbl_hh_output(dp->nxt_hop, skb) == 0)
+			return 0;
+
 		/* Get hardware destination address */
-		if (neigh_tbl_query(dp->nxt_hop, &neigh_info) < 0) {
+		if (!neigh_tbl_query(dp->nxt_hop, &neigh_info)) {
 			LOG_DBG("Could not get hardware address for next hop %s\n",
 			     print_ip(dp->nxt_hop));
 			return -1;
@@ -150,16 +287,24 @@ int dsr_hw_header_create(struct dsr_pkt *dp, struct sk_buff *skb)
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
 	if (skb->dev->hard_header) {
-		skb->dev->hard_header(skb, skb->dev, ETH_P_IP,
-				      neigh_info.hw_addr.sa_data, 0, skb->len);
+		hh_len = skb->dev->hard_header(skb, skb->dev, ETH_P_IP,
+					       neigh_info.hw_addr.sa_data, 0,
+					       skb->len);
 	} else {
 		LOG_DBG("Missing hard_header\n");
 		return -1;
 	}
 #else
-	dev_hard_header(skb, skb->dev, ETH_P_IP,
-			neigh_info.hw_addr.sa_data, 0, skb->len);	
+	hh_len = dev_hard_header(skb, skb->dev, ETH_P_IP,
+				 neigh_info.hw_addr.sa_data, 0, skb->len);
 #endif
+	if (hh_len < 0)
+		return -1;
+
+	/* Cache the header for the next packet to this neighbor */
+	if (dp->dst.s_addr != DSR_BROADCAST)
+		neigh_tbl_hh_update(dp->nxt_hop, &neigh_info, skb, hh_len);
+
 	return 0;
 }
 
@@ -239,14 +384,16 @@ static int dsr_dev_netdev_event(struct notifier_block *this,
 			dev_hold(dev);
 			dsr_node_unlock(dnode);
 
-			/* Reduce the MTU to allow DSR options of 100
-			 * bytes. If larger, drop or implement
-			 * fragmentation... ;-) Alternatively find a
-			 * way to dynamically reduce the data size of
-			 * packets depending on the size of the DSR
-			 * header. */
-			dsr_dev->mtu = dev->mtu - DSR_OPTS_MAX_SIZE;
-			
+			/* Leave room for the options of a one hop
+			 * route. Senders on longer routes learn their
+			 * path MTU from dsr_dev_frag_needed(). */
+			dsr_dev->mtu = dev->mtu - DSR_OPTS_MIN_SIZE;
+#ifdef DSR_SG_XMIT
+			/* Have the stack leave room for the DSR header
+			 * and the slave's link layer header */
+			dsr_dev->needed_headroom = LL_RESERVED_SPACE(dev) +
+				DSR_OPTS_HEADROOM;
+#endif
 			LOG_DBG("Registering packet type\n");
 			dsr_packet_type.func = dsr_dev_llrecv;
 			dsr_packet_type.dev = dev;
@@ -261,6 +408,18 @@ static int dsr_dev_netdev_event(struct notifier_block *this,
 	case NETDEV_CHANGE:
 		LOG_DBG("Netdev change\n");
 		break;
+	case NETDEV_CHANGEMTU:
+		if (dev == dnode->slave_dev) {
+			LOG_DBG("Slave dev %s mtu %d\n", dev->name, dev->mtu);
+			dsr_dev->mtu = dev->mtu - DSR_OPTS_MIN_SIZE;
+		}
+		break;
+	case NETDEV_CHANGEADDR:
+		LOG_DBG("Netdev change address %s\n", dev->name);
+		/* Cached link layer headers carry the old source address */
+		if (dev == dnode->slave_dev)
+			neigh_tbl_hh_flush();
+		break;
 	case NETDEV_UP:
 		LOG_DBG("Netdev up %s\n", dev->name);
 		if (ConfVal(PromiscOperation) &&
@@ -280,9 +439,14 @@ static int dsr_dev_netdev_event(struct notifier_block *this,
 		}
 		dsr_node_unlock(dnode);
 
-		if (slave_change)
+		if (slave_change) {
 			LOG_DBG("DSR slave interface %s unregisterd\n",
 			      dev->name);
+			neigh_tbl_hh_flush();
+#ifdef DSR_JITTER_QUEUE
+			dsr_jitter_purge();
+#endif
+		}
 		break;
 	case NETDEV_DOWN:
 		LOG_DBG("Netdev down %s\n", dev->name);
@@ -410,6 +574,9 @@ static void dsr_dev_setup(struct net_device *dev)
 	//dev->destructor = dsr_dev_free;
 
 	dev->tx_queue_len = 0;
+#ifdef DSR_SG_XMIT
+	dev->features |= NETIF_F_SG | NETIF_F_HW_CSUM;
+#endif
 	dev->flags |= IFF_NOARP;
 	dev->flags &= ~IFF_MULTICAST;
 	get_random_bytes(dev->dev_addr, 6);
@@ -507,7 +674,11 @@ int dsr_dev_deliver(struct dsr_pkt *dp)
 	if (dp->dh.raw)
 		len = dsr_opt_remove(dp);
 
-	skb = dsr_skb_create(dp, dsr_dev);
+	/* Strip the DSR header in place if we can */
+	skb = dsr_skb_reuse(dp, dsr_dev);
+
+	if (!skb)
+		skb = dsr_skb_create(dp, dsr_dev);
 
 	if (!skb) {
 		LOG_DBG("Could not allocate skb\n");
@@ -521,6 +692,14 @@ int dsr_dev_deliver(struct dsr_pkt *dp)
 	/* skb->mac.raw = skb->data - dsr_dev->hard_header_len; */
 
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	skb->pkt_type = PACKET_HOST;
+
+	/* Connection tracking saw the DSR packet, not the one inside */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,4,0)
+	nf_reset(skb);
+#else
+	nf_reset_ct(skb);
+#endif
 	
 	ethh = (struct ethhdr *)SKB_MAC_HDR_RAW(skb);
 
@@ -533,13 +712,121 @@ int dsr_dev_deliver(struct dsr_pkt *dp)
 	dsr_node->stats.rx_bytes += skb->len;
 	dsr_node_unlock(dsr_node);
 
-	netif_rx(skb);
-
 	dsr_pkt_free(dp);
 
+	/* We are in the receive softirq of the slave, or in a DSR timer, so
+	 * hand the packet straight to the stack instead of going through the
+	 * netif_rx() backlog */
+	netif_receive_skb(skb);
+
+	return 0;
+}
+
+static int dsr_dev_queue_xmit(struct sk_buff *skb)
+{
+	int len = skb->len;
+	int res;
+
+	/* TODO: Should consider using ip_finish_output instead */
+	res = dev_queue_xmit(skb);
+
+	if (res < 0)
+		return res;
+
+	dsr_node_lock(dsr_node);
+	dsr_node->stats.tx_packets++;
+	dsr_node->stats.tx_bytes += len;
+	dsr_node_unlock(dsr_node);
+
+	return res;
+}
+
+#ifdef DSR_JITTER_QUEUE
+static enum hrtimer_restart dsr_jitter_timeout(struct hrtimer *timer)
+{
+	tasklet_schedule(&jitter_tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+static void dsr_jitter_release(unsigned long data)
+{
+	struct sk_buff_head batch;
+	struct sk_buff *skb;
+	s64 now = ktime_to_ns(ktime_get());
+	int n = 0;
+
+	skb_queue_head_init(&batch);
+
+	spin_lock_bh(&jitter_queue.lock);
+
+	while (n < JITTER_BATCH_MAX && (skb = skb_peek(&jitter_queue)) &&
+	       JITTER_CB(skb)->release <= now + JITTER_SLACK_NSECS) {
+		__skb_unlink(skb, &jitter_queue);
+		__skb_queue_tail(&batch, skb);
+		n++;
+	}
+
+	/* Rearm for the next packet. If we stopped because the batch was
+	 * full, the timer fires immediately and we continue from there. */
+	skb = skb_peek(&jitter_queue);
+
+	if (skb)
+		hrtimer_start(&jitter_timer, ns_to_ktime(JITTER_CB(skb)->release),
+			      HRTIMER_MODE_ABS);
+
+	spin_unlock_bh(&jitter_queue.lock);
+
+	while ((skb = __skb_dequeue(&batch)))
+		dsr_dev_queue_xmit(skb);
+}
+
+/* Returns 0 if the packet was queued, -1 if it should be sent now */
+static int dsr_jitter_enqueue(struct sk_buff *skb)
+{
+	struct sk_buff *pos;
+	s64 release;
+
+	release = ktime_to_ns(ktime_get()) +
+	    (s64)random_jitter(ConfValToUsecs(BroadCastJitter)) * 1000;
+
+	spin_lock_bh(&jitter_queue.lock);
+
+	if (skb_queue_len(&jitter_queue) >= JITTER_QUEUE_MAX_LEN) {
+		spin_unlock_bh(&jitter_queue.lock);
+		return -1;
+	}
+
+	JITTER_CB(skb)->release = release;
+
+	skb_queue_walk(&jitter_queue, pos) {
+		if (JITTER_CB(pos)->release > release)
+			break;
+	}
+	__skb_queue_before(&jitter_queue, pos, skb);
+
+	if (skb_peek(&jitter_queue) == skb)
+		hrtimer_start(&jitter_timer, ns_to_ktime(release),
+			      HRTIMER_MODE_ABS);
+
+	spin_unlock_bh(&jitter_queue.lock);
+
 	return 0;
 }
 
+/* Empty the queue first, so that a release already running finds nothing
+ * to rearm the timer for */
+static void dsr_jitter_purge(void)
+{
+	spin_lock_bh(&jitter_queue.lock);
+	__skb_queue_purge(&jitter_queue);
+	spin_unlock_bh(&jitter_queue.lock);
+
+	hrtimer_cancel(&jitter_timer);
+	tasklet_kill(&jitter_tasklet);
+}
+#endif
+
 int dsr_dev_xmit(struct dsr_pkt *dp)
 {
 	struct sk_buff *skb;
@@ -564,7 +851,11 @@ int dsr_dev_xmit(struct dsr_pkt *dp)
 	}
 	dsr_node_unlock(dsr_node);
 
-	skb = dsr_skb_create(dp, slave_dev);
+	/* Forwarded packets go out in the skb they arrived in */
+	skb = dsr_skb_reuse(dp, slave_dev);
+
+	if (!skb)
+		skb = dsr_skb_create(dp, slave_dev);
 
 	if (!skb) {
 		LOG_DBG("Could not create skb!\n");
@@ -586,16 +877,14 @@ int dsr_dev_xmit(struct dsr_pkt *dp)
 	      print_eth(SKB_MAC_HDR_RAW(skb)),
 	      print_ip(dst));
 		
-	/* TODO: Should consider using ip_finish_output instead */
-	res = dev_queue_xmit(skb);
-
-	if (res < 0)
+#ifdef DSR_JITTER_QUEUE
+	if (dp->flags & PKT_XMIT_JITTER && ConfVal(BroadCastJitter) &&
+	    dsr_jitter_enqueue(skb) == 0) {
+		res = 0;
 		goto out_err;
-
-	dsr_node_lock(dsr_node);
-	dsr_node->stats.tx_packets++;
-	dsr_node->stats.tx_bytes += len;
-	dsr_node_unlock(dsr_node);
+	}
+#endif
+	res = dsr_dev_queue_xmit(skb);
 
 out_err:
 	dsr_pkt_free(dp);
@@ -603,6 +892,37 @@ out_err:
 	return res;
 }
 
+/* Largest packet the slave interface takes, 0 if there is none */
+int dsr_dev_link_mtu(void)
+{
+	int mtu = 0;
+
+	dsr_node_lock(dsr_node);
+
+	if (dsr_node->slave_dev)
+		mtu = dsr_node->slave_dev->mtu;
+
+	dsr_node_unlock(dsr_node);
+
+	return mtu;
+}
+
+/* Report the path MTU of the route to the sender of a packet that does not
+ * fit it. Our own senders are told even without DF, so that the stack
+ * fragments to the path MTU from then on. */
+void dsr_dev_frag_needed(struct dsr_pkt *dp, int mtu)
+{
+	if (!dp || !dp->skb)
+		return;
+
+	LOG_DBG("Packet to %s too big, path mtu %d\n", print_ip(dp->dst), mtu);
+
+	if (dp->src.s_addr == my_addr().s_addr ||
+	    (dp->nh.iph->frag_off & htons(IP_DF)))
+		icmp_send(dp->skb, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED,
+			  htonl(mtu));
+}
+
 /* Main receive function for packets originated in user space */
 static int dsr_dev_start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
@@ -626,7 +946,15 @@ static int dsr_dev_start_xmit(struct sk_buff *skb, struct net_device *dev)
 		LOG_DBG("dst=%s len=%d\n",
 		      print_ip(*((struct in_addr *)&SKB_NETWORK_HDR_IPH(skb)->daddr)),
 		      skb->len);
-
+#ifdef DSR_SG_XMIT
+		/* No NIC parses the transport header behind a DSR header,
+		 * so finish the checksum here. This only reads the data. */
+		if (skb->ip_summed == CHECKSUM_PARTIAL &&
+		    skb_checksum_help(skb)) {
+			dev_kfree_skb_any(skb);
+			return 0;
+		}
+#endif
 		dp = dsr_pkt_alloc(skb);
 		
 		if (!dp) {
@@ -683,6 +1011,13 @@ int dsr_dev_init(char *ifname)
 
 	dsr_node_init(dnode, ifname);
 
+#ifdef DSR_JITTER_QUEUE
+	skb_queue_head_init(&jitter_queue);
+	hrtimer_init(&jitter_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	jitter_timer.function = dsr_jitter_timeout;
+	tasklet_init(&jitter_tasklet, dsr_jitter_release, 0);
+#endif
+
 	if (!ifname) {
 		struct net_device *dev;
 		int is_wireless = 0;
@@ -753,6 +1088,9 @@ void __exit dsr_dev_cleanup(void)
 
 	unregister_netdevice_notifier(&netdev_notifier);
 	unregister_inetaddr_notifier(&inetaddr_notifier);
+#ifdef DSR_JITTER_QUEUE
+	dsr_jitter_purge();
+#endif
 	unregister_netdev(dsr_dev);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,5,0)
 	free_netdev(dsr_dev);
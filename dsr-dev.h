@@ -18,6 +18,8 @@
 
 int dsr_dev_xmit(struct dsr_pkt *dp);
 int dsr_dev_deliver(struct dsr_pkt *dp);
+int dsr_dev_link_mtu(void);
+void dsr_dev_frag_needed(struct dsr_pkt *dp, int mtu);
 
 int __init dsr_dev_init(char *ifname);
 void __exit dsr_dev_cleanup(void);
@@ -0,0 +1,418 @@
+/* Copyright (C) Uppsala University
+ *
+ * This file is distributed under the terms of the GNU general Public
+ * License (GPL), see the file LICENSE
+ *
+ * Author: Erik Nordström, <erikn@it.uu.se>
+ */
+#ifdef __KERNEL__
+#include <net/ip.h>
+#include "dsr-dev.h"
+#endif
+
+#ifdef NS2
+#include "ns-agent.h"
+#endif
+
+#include "dsr.h"
+#include "dsr-flow.h"
+#include "dsr-opt.h"
+#include "dsr-srt.h"
+#include "dsr-rerr.h"
+#include "debug.h"
+#include "tbl.h"
+#include "timer.h"
+
+#define FLOW_TBL_MAX_LEN 64
+
+#ifdef __KERNEL__
+static TBL(flow_tbl, FLOW_TBL_MAX_LEN);
+static unsigned short flow_id;	/* Protected by the flow_tbl lock */
+#endif
+
+/* Flow state kept by all nodes on the path. The source also holds a
+ * reference to the route the flow was established with; as long as the
+ * route cache hands out a route with the same hops, the flow is still
+ * valid. */
+struct flow_entry {
+	list_t l;
+	struct in_addr src, dst, nxt_hop;
+	unsigned short id;
+	struct dsr_srt *srt;	/* Only set at the source */
+	struct timeval expires;
+};
+
+struct flow_query {
+	struct in_addr src, dst;
+	unsigned short id;
+};
+
+static inline int crit_flow_src(void *pos, void *data)
+{
+	struct flow_entry *e = (struct flow_entry *)pos;
+	struct flow_query *q = (struct flow_query *)data;
+
+	if (e->srt && e->dst.s_addr == q->dst.s_addr)
+		return 1;
+
+	return 0;
+}
+
+static inline int crit_flow(void *pos, void *data)
+{
+	struct flow_entry *e = (struct flow_entry *)pos;
+	struct flow_query *q = (struct flow_query *)data;
+
+	if (e->id == q->id && e->src.s_addr == q->src.s_addr &&
+	    e->dst.s_addr == q->dst.s_addr)
+		return 1;
+
+	return 0;
+}
+
+static inline int flow_srt_equal(struct dsr_srt *srt1, struct dsr_srt *srt2)
+{
+	if (srt1 == srt2)
+		return 1;
+
+	return (srt1->laddrs == srt2->laddrs &&
+		memcmp(srt1->addrs, srt2->addrs, srt1->laddrs) == 0);
+}
+
+static inline int do_flow_free(void *pos, void *data)
+{
+	struct flow_entry *e = (struct flow_entry *)pos;
+
+	if (e->srt)
+		dsr_srt_put(e->srt);
+
+	return 0;
+}
+
+/* Entries are not timed out, but checked on lookup. Must be called with the
+ * flow_tbl lock held. */
+static struct flow_entry *__flow_tbl_find(struct tbl *t, struct flow_query *q,
+					  criteria_t crit)
+{
+	struct flow_entry *e;
+	struct timeval now;
+
+	e = (struct flow_entry *)__tbl_find(t, q, crit);
+
+	if (!e)
+		return NULL;
+
+	gettime(&now);
+
+	if (timeval_diff(&e->expires, &now) > 0)
+		return e;
+
+	__tbl_detach(t, &e->l);
+	do_flow_free(e, NULL);
+	kfree(e);
+
+	return NULL;
+}
+
+/* Must be called with the flow_tbl lock held */
+static int __flow_tbl_add(struct tbl *t, struct flow_entry *e)
+{
+	struct flow_entry *old;
+
+	/* Make room by dropping the oldest flow */
+	if (TBL_FULL(t)) {
+		old = (struct flow_entry *)__tbl_detach_first(t);
+
+		if (old) {
+			do_flow_free(old, NULL);
+			kfree(old);
+		}
+	}
+	return __tbl_add_tail(t, &e->l);
+}
+
+/* Look up the flow that a packet to dp->dst over dp->srt should use. A new
+ * flow is set up if there is none, or if the route has changed since the
+ * flow was established. */
+int NSCLASS dsr_flow_get(struct dsr_pkt *dp, unsigned short *id)
+{
+	struct flow_entry *e;
+	struct flow_query q;
+
+	if (!dp || !dp->srt || !id)
+		return FLOW_NONE;
+
+	q.src = dp->src;
+	q.dst = dp->dst;
+
+	write_lock_bh(&flow_tbl.lock);
+
+	e = __flow_tbl_find(&flow_tbl, &q, crit_flow_src);
+
+	if (e && flow_srt_equal(e->srt, dp->srt)) {
+		*id = e->id;
+		write_unlock_bh(&flow_tbl.lock);
+		return FLOW_ESTABLISHED;
+	}
+
+	if (e) {
+		LOG_DBG("Route to %s changed, new flow\n", print_ip(dp->dst));
+		__tbl_detach(&flow_tbl, &e->l);
+		do_flow_free(e, NULL);
+		kfree(e);
+	}
+
+	e = (struct flow_entry *)kmalloc(sizeof(struct flow_entry),
+					 GFP_ATOMIC);
+
+	if (!e) {
+		write_unlock_bh(&flow_tbl.lock);
+		return FLOW_NONE;
+	}
+
+	/* The source picks even flow ids for flows that are not the default
+	 * flow */
+	flow_id += 2;
+
+	e->src = dp->src;
+	e->dst = dp->dst;
+	e->nxt_hop = dp->nxt_hop;
+	e->id = flow_id;
+	e->srt = dsr_srt_get(dp->srt);
+
+	/* Downstream nodes start their timeout when the establishing packet
+	 * arrives, so the source always gives up on the flow first */
+	gettime(&e->expires);
+	timeval_add_usecs(&e->expires, ConfValToUsecs(FlowStateTimeout));
+
+	__flow_tbl_add(&flow_tbl, e);
+
+	*id = e->id;
+
+	write_unlock_bh(&flow_tbl.lock);
+
+	LOG_DBG("New flow %u to %s\n", *id, print_ip(dp->dst));
+
+	return FLOW_NEW;
+}
+
+/* Add a Flow State header instead of a DSR options header. It carries the
+ * flow id in the place of the payload length, so no options follow. The
+ * source only uses flows when link layer feedback maintains them, see
+ * dsr_srt_add(). */
+int NSCLASS dsr_flow_hdr_add(struct dsr_pkt *dp, unsigned short id)
+{
+	struct dsr_opt_hdr *opth;
+	int ttl, tot_len, ip_len;
+	int prot = 0;
+
+	opth = (struct dsr_opt_hdr *)dsr_pkt_alloc_opts(dp, DSR_OPT_HDR_LEN);
+
+	if (!opth)
+		return -1;
+#ifdef NS2
+	if (dp->p) {
+		hdr_cmn *cmh = HDR_CMN(dp->p);
+		prot = cmh->ptype();
+	} else
+		prot = PT_NTYPE;
+
+	ip_len = IP_HDR_LEN;
+	tot_len = dp->payload_len + ip_len + DSR_OPT_HDR_LEN;
+	ttl = dp->nh.iph->ttl();
+#else
+	prot = dp->nh.iph->protocol;
+	ip_len = (dp->nh.iph->ihl << 2);
+	tot_len = ntohs(dp->nh.iph->tot_len) + DSR_OPT_HDR_LEN;
+	ttl = dp->nh.iph->ttl;
+#endif
+	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, ip_len, tot_len,
+				  IPPROTO_DSR, ttl);
+
+	if (!dp->nh.iph)
+		return -1;
+
+	opth->nh = prot;
+	opth->f = 1;
+	opth->res = 0;
+	opth->p_len = htons(id);
+
+	dp->dh.opth = opth;
+	dp->srt_opt = NULL;
+
+	/* There is no room for an ACK Request, so next hop reachability is
+	 * left to link layer feedback */
+	dp->flags &= ~PKT_REQUEST_ACK;
+
+	return 0;
+}
+
+/* Build the Timeout and Destination and Flow ID options that establish a
+ * flow along the source route they follow */
+int NSCLASS dsr_flow_opts_add(char *buf, int len, unsigned short id,
+			      struct in_addr dst)
+{
+	struct dsr_timeout_opt *timeout_opt;
+	struct dsr_flowid_opt *flowid_opt;
+
+	if (!buf || len < (int)DSR_FLOW_OPTS_LEN)
+		return -1;
+
+	timeout_opt = (struct dsr_timeout_opt *)buf;
+	timeout_opt->type = DSR_OPT_TIMEOUT;
+	timeout_opt->length = DSR_TIMEOUT_OPT_LEN;
+	timeout_opt->timeout = htons(ConfVal(FlowStateTimeout));
+
+	flowid_opt = (struct dsr_flowid_opt *)(buf +
+					       sizeof(struct dsr_timeout_opt));
+	flowid_opt->type = DSR_OPT_FLOWID;
+	flowid_opt->length = DSR_FLOWID_OPT_LEN;
+	flowid_opt->id = htons(id);
+	flowid_opt->dst = dst.s_addr;
+
+	return DSR_FLOW_OPTS_LEN;
+}
+
+/* Record a flow being established through us. The Source Route option has
+ * already been processed, so dp->nxt_hop is where the flow goes. */
+int NSCLASS dsr_flowid_opt_recv(struct dsr_pkt *dp,
+				struct dsr_flowid_opt *flowid_opt)
+{
+	struct dsr_timeout_opt *timeout_opt;
+	struct flow_entry *e;
+	struct flow_query q;
+
+	if (!dp || !flowid_opt)
+		return DSR_PKT_ERROR;
+
+	if (dp->flags & PKT_PROMISC_RECV || !dp->srt_opt ||
+	    dp->dst.s_addr == my_addr().s_addr)
+		return DSR_PKT_NONE;
+
+	timeout_opt = (struct dsr_timeout_opt *)dsr_opt_find_opt(dp,
+							 DSR_OPT_TIMEOUT);
+
+	if (!timeout_opt || !timeout_opt->timeout)
+		return DSR_PKT_NONE;
+
+	q.src = dp->src;
+	q.dst.s_addr = flowid_opt->dst;
+	q.id = ntohs(flowid_opt->id);
+
+	write_lock_bh(&flow_tbl.lock);
+
+	e = __flow_tbl_find(&flow_tbl, &q, crit_flow);
+
+	if (!e) {
+		e = (struct flow_entry *)kmalloc(sizeof(struct flow_entry),
+						 GFP_ATOMIC);
+		if (!e) {
+			write_unlock_bh(&flow_tbl.lock);
+			return DSR_PKT_NONE;
+		}
+		e->src = q.src;
+		e->dst = q.dst;
+		e->id = q.id;
+		e->srt = NULL;
+
+		__flow_tbl_add(&flow_tbl, e);
+	}
+
+	e->nxt_hop = dp->nxt_hop;
+	gettime(&e->expires);
+	timeval_add_usecs(&e->expires,
+			  (usecs_t)ntohs(timeout_opt->timeout) * 1000000);
+
+	write_unlock_bh(&flow_tbl.lock);
+
+	LOG_DBG("Flow %u %s->%s nxt_hop=%s\n", q.id, print_ip(q.src),
+		print_ip(q.dst), print_ip(e->nxt_hop));
+
+	return DSR_PKT_NONE;
+}
+
+/* Forward a packet that only carries a Flow State header */
+int NSCLASS dsr_flow_recv(struct dsr_pkt *dp)
+{
+	struct flow_entry *e;
+	struct flow_query q;
+
+	if (!dp || !dp->dh.opth->f)
+		return DSR_PKT_ERROR;
+
+	if (dp->flags & PKT_PROMISC_RECV)
+		return DSR_PKT_DROP;
+
+	if (dp->dst.s_addr == my_addr().s_addr)
+		return DSR_PKT_NONE;
+
+	q.src = dp->src;
+	q.dst = dp->dst;
+	q.id = ntohs(dp->dh.opth->p_len);
+
+	read_lock_bh(&flow_tbl.lock);
+
+	e = (struct flow_entry *)__tbl_find(&flow_tbl, &q, crit_flow);
+
+	if (e) {
+		struct timeval now;
+
+		gettime(&now);
+
+		if (timeval_diff(&e->expires, &now) > 0)
+			dp->nxt_hop = e->nxt_hop;
+		else
+			e = NULL;
+	}
+	read_unlock_bh(&flow_tbl.lock);
+
+	if (!e) {
+		LOG_DBG("Unknown flow %u %s->%s\n", q.id, print_ip(q.src),
+			print_ip(q.dst));
+		dsr_rerr_flow_send(dp);
+		return DSR_PKT_DROP;
+	}
+
+	if (dp->dh.opth->res < 0x7f)
+		dp->dh.opth->res++;
+
+	dp->flags &= ~PKT_REQUEST_ACK;
+
+	return DSR_PKT_FORWARD;
+}
+
+/* A node on the path lost the flow. The next packet will establish a new
+ * one using the full source route. */
+void NSCLASS dsr_flow_del(struct in_addr dst, unsigned short id)
+{
+	struct flow_entry *e;
+	struct flow_query q;
+
+	q.src = my_addr();
+	q.dst = dst;
+	q.id = id;
+
+	e = (struct flow_entry *)tbl_find_detach(&flow_tbl, &q, crit_flow);
+
+	if (!e)
+		return;
+
+	LOG_DBG("Flow %u to %s lost downstream\n", id, print_ip(dst));
+
+	do_flow_free(e, NULL);
+	kfree(e);
+}
+
+int __init NSCLASS flow_tbl_init(void)
+{
+	INIT_TBL(&flow_tbl, FLOW_TBL_MAX_LEN);
+
+	flow_id = 0;
+
+	return 0;
+}
+
+void __exit NSCLASS flow_tbl_cleanup(void)
+{
+	tbl_flush(&flow_tbl, do_flow_free);
+}
@@ -0,0 +1,61 @@
+/* Copyright (C) Uppsala University
+ *
+ * This file is distributed under the terms of the GNU general Public
+ * License (GPL), see the file LICENSE
+ *
+ * Author: Erik Nordström, <erikn@it.uu.se>
+ */
+#ifndef _DSR_FLOW_H
+#define _DSR_FLOW_H
+
+#include "dsr.h"
+#include "dsr-pkt.h"
+
+#ifdef NS2
+#include "endian.h"
+#endif
+
+#ifndef NO_GLOBALS
+
+/* Carried on the packet that establishes a flow, together with the full
+ * source route */
+struct dsr_timeout_opt {
+	u_int8_t type;
+	u_int8_t length;
+	u_int16_t timeout;	/* Flow lifetime in seconds */
+};
+
+struct dsr_flowid_opt {
+	u_int8_t type;
+	u_int8_t length;
+	u_int16_t id;
+	u_int32_t dst;
+};
+
+#define DSR_TIMEOUT_OPT_LEN (sizeof(struct dsr_timeout_opt) - 2)
+#define DSR_FLOWID_OPT_LEN (sizeof(struct dsr_flowid_opt) - 2)
+#define DSR_FLOW_OPTS_LEN (sizeof(struct dsr_timeout_opt) + \
+			   sizeof(struct dsr_flowid_opt))
+
+/* Return values of dsr_flow_get() */
+#define FLOW_NONE         0
+#define FLOW_NEW          1	/* Send the route and establish the flow */
+#define FLOW_ESTABLISHED  2	/* Send the Flow State header only */
+
+#endif				/* NO_GLOBALS */
+
+#ifndef NO_DECLS
+
+int dsr_flow_get(struct dsr_pkt *dp, unsigned short *id);
+int dsr_flow_hdr_add(struct dsr_pkt *dp, unsigned short id);
+int dsr_flow_opts_add(char *buf, int len, unsigned short id,
+		      struct in_addr dst);
+int dsr_flow_recv(struct dsr_pkt *dp);
+int dsr_flowid_opt_recv(struct dsr_pkt *dp, struct dsr_flowid_opt *flowid_opt);
+void dsr_flow_del(struct in_addr dst, unsigned short id);
+int flow_tbl_init(void);
+void flow_tbl_cleanup(void);
+
+#endif				/* NO_DECLS */
+
+#endif				/* _DSR_FLOW_H */
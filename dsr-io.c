@@ -72,15 +72,22 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 		case DSR_PKT_FORWARD:
 
 #ifdef NS2
-			if (dp->nh.iph->ttl() < 1)
+			if (dp->nh.iph->ttl() <= 1)
 #else
-			if (dp->nh.iph->ttl < 1)
+			if (dp->nh.iph->ttl <= 1)
 #endif
 			{
-				LOG_DBG("ttl=0, dropping!\n");
+				LOG_DBG("ttl expired, dropping!\n");
 				dsr_pkt_free(dp);
 				return 0;
 			} else {
+				/* The checksum is redone when the packet
+				 * is sent */
+#ifdef NS2
+				dp->nh.iph->ttl()--;
+#else
+				dp->nh.iph->ttl--;
+#endif
 				LOG_DBG("Forwarding %s %s nh %s\n",
 				      print_ip(dp->src),
 				      print_ip(dp->dst), print_ip(dp->nxt_hop));
@@ -89,7 +96,8 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 			}
 			break;
 		case DSR_PKT_FORWARD_RREQ:
-			XMIT(dp);
+			if (!rreq_fwd_tbl_hold(dp))
+				XMIT(dp);
 			return 0;
 		case DSR_PKT_SEND_RREP:
 			/* In dsr-rrep.c */
@@ -106,6 +114,7 @@ int NSCLASS dsr_recv(struct dsr_pkt *dp)
 					rrep_srt_dst.s_addr = dp->rrep_opt[i]->addrs[DSR_RREP_ADDRS_LEN(dp->rrep_opt[i]) / sizeof(struct in_addr)];
 					
 					send_buf_set_verdict(SEND_BUF_SEND, rrep_srt_dst);
+					maint_buf_repair_send(rrep_srt_dst);
 				}
 			}
 				break;
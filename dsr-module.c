@@ -39,6 +39,8 @@
 #include "neigh.h"
 #include "dsr-rreq.h"
 #include "dsr-rrep.h"
+#include "dsr-rerr.h"
+#include "dsr-flow.h"
 #include "maint-buf.h"
 #include "send-buf.h"
 #include "link-cache.h"
@@ -404,11 +406,23 @@ static int __init dsr_module_init(void)
 	if (res < 0)
 		goto cleanup_nf_hook2;
 
-	res = maint_buf_init();
+	res = rerr_tbl_init();
 
 	if (res < 0)
 		goto cleanup_nf_hook1;
 
+	/* Maintenance timeouts send RERRs, so the buffer goes after the RERR
+	 * table and is torn down before it */
+	res = maint_buf_init();
+
+	if (res < 0)
+		goto cleanup_rerr_tbl;
+
+	res = flow_tbl_init();
+
+	if (res < 0)
+		goto cleanup_maint_buf;
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
 #define proc_net init_net.proc_net
 #endif
@@ -417,7 +431,7 @@ static int __init dsr_module_init(void)
 	proc = create_proc_entry(CONFIG_PROC_NAME, S_IRUGO | S_IWUSR, proc_net);
 
 	if (!proc)
-		goto cleanup_maint_buf;
+		goto cleanup_flow_tbl;
 
 	proc->owner = THIS_MODULE;
 	proc->read_proc = dsr_config_proc_read;
@@ -433,7 +447,7 @@ static int __init dsr_module_init(void)
 	proc = proc_create(CONFIG_PROC_NAME, S_IRUGO | S_IWUSR, proc_net,
 												&dsr_config_proc_fops);
 	if (!proc)
-		goto cleanup_maint_buf;
+		goto cleanup_flow_tbl;
 
 #endif
 
@@ -463,8 +477,12 @@ cleanup_proc:
 
 #endif /* KERNEL26 */
 
+cleanup_flow_tbl:
+	flow_tbl_cleanup();
 cleanup_maint_buf:
 	maint_buf_cleanup();
+cleanup_rerr_tbl:
+	rerr_tbl_cleanup();
 cleanup_nf_hook1:
 	nf_unregister_hook(&dsr_ip_forward_hook);
 cleanup_nf_hook2:
@@ -503,10 +521,14 @@ static void __exit dsr_module_cleanup(void)
 	/* proc_net_remove is removed from 3.10, use remove_proc_entry */
 	remove_proc_entry (CONFIG_PROC_NAME, proc_net);
 #endif
+	/* Maintenance timeouts start route discoveries and send RERRs */
+	maint_buf_timers_stop();
 	rreq_tbl_cleanup();
 	grat_rrep_tbl_cleanup();
 	neigh_tbl_cleanup();
 	maint_buf_cleanup();
+	rerr_tbl_cleanup();
+	flow_tbl_cleanup();
 	send_buf_cleanup();
 #ifdef DEBUG
 	dbg_cleanup();
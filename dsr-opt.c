@@ -21,6 +21,7 @@
 #include "dsr-rerr.h"
 #include "dsr-srt.h"
 #include "dsr-ack.h"
+#include "dsr-flow.h"
 
 struct dsr_opt_hdr *dsr_opt_hdr_add(char *buf, unsigned int len, 
 				    unsigned int protocol)
@@ -163,6 +164,8 @@ int dsr_opt_parse(struct dsr_pkt *dp)
 			break;
 		case DSR_OPT_PREV_HOP:
 			break;
+		case DSR_OPT_RREQ_TRGS:
+			break;
 		case DSR_OPT_ACK:
 			if (dp->num_ack_opts < MAX_ACK_OPTS)
 				dp->ack_opt[dp->num_ack_opts++] = (struct dsr_ack_opt *)dopt;
@@ -231,6 +234,10 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 	if (dp->dst.s_addr == myaddr.s_addr && dp->payload_len != 0)
 		action |= DSR_PKT_DELIVER;
 #endif
+	/* A Flow State header carries no options */
+	if (dp->dh.opth->f)
+		return action | dsr_flow_recv(dp);
+
 	dsr_len = dsr_pkt_opts_len(dp);
 
 	l = DSR_OPT_HDR_LEN;
@@ -250,6 +257,10 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 			action |= dsr_rreq_opt_recv(dp, (struct dsr_rreq_opt *)dopt);
 			break;
 		case DSR_OPT_RREP:
+			/* Any reply to the initiator may make our own
+			 * delayed cached reply unnecessary */
+			dsr_rrep_opt_overheard(dp, (struct dsr_rrep_opt *)dopt);
+
 			/* We should probably allow promisuously
 			 * receiving RREPs */
 			if (dp->flags & PKT_PROMISC_RECV)
@@ -260,6 +271,10 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 		case DSR_OPT_RERR:
 			if (dp->flags & PKT_PROMISC_RECV)
 				break;
+			/* Errors carried on a RREQ are handled together
+			 * with the RREQ option */
+			if (dp->rreq_opt)
+				break;
 			if (dp->num_rerr_opts < MAX_RERR_OPTS) {
 				action |=
 				    dsr_rerr_opt_recv(dp, (struct dsr_rerr_opt *)dopt);
@@ -268,6 +283,9 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 			break;
 		case DSR_OPT_PREV_HOP:
 			break;
+		case DSR_OPT_RREQ_TRGS:
+			/* Handled together with the RREQ option */
+			break;
 		case DSR_OPT_ACK:
 			if (dp->flags & PKT_PROMISC_RECV)
 				break;
@@ -281,11 +299,18 @@ int NSCLASS dsr_opt_recv(struct dsr_pkt *dp)
 			}
 			break;
 		case DSR_OPT_SRT:
+			/* The initiator is already using a route to the
+			 * destination, see section 8.2.5 of the draft */
+			rrep_delay_tbl_cancel(dp->src, dp->dst,
+					      DSR_SRT_OPT_HOPS((struct dsr_srt_opt *)
+							       dopt));
 			action |= dsr_srt_opt_recv(dp, (struct dsr_srt_opt *)dopt);
 			break;
 		case DSR_OPT_TIMEOUT:
 			break;
 		case DSR_OPT_FLOWID:
+			action |= dsr_flowid_opt_recv(dp, (struct dsr_flowid_opt *)
+						      dopt);
 			break;
 		case DSR_OPT_ACK_REQ:
 			action |=
@@ -48,7 +48,7 @@ struct dsr_opt_hdr {
 	}
 
 	int size() {
-		return p_len + sizeof(struct dsr_opt_hdr);
+		return (f ? 0 : p_len) + sizeof(struct dsr_opt_hdr);
 	}
 #endif				/* NS2 */
 	struct dsr_opt option[0];
@@ -69,6 +69,16 @@ struct dsr_pad1_opt {
 				 * is not the case in ns-2 */
 #define DSR_OPT_HDR_LEN sizeof(struct dsr_opt_hdr)
 #define DSR_OPT_PAD1_LEN 1
+
+/* With the F bit set the header is a Flow State header, which has the flow
+ * id where the payload length would be and is not followed by options */
+#ifdef NS2
+#define DSR_OPTS_LEN(opth) \
+	(((opth)->f ? 0 : (opth)->p_len) + DSR_OPT_HDR_LEN)
+#else
+#define DSR_OPTS_LEN(opth) \
+	(((opth)->f ? 0 : ntohs((opth)->p_len)) + DSR_OPT_HDR_LEN)
+#endif
 #define DSR_PKT_MIN_LEN 24	/* IP header + DSR header =  20 + 4 */
 
 /* Header types */
@@ -77,6 +87,9 @@ struct dsr_pad1_opt {
 #define DSR_OPT_RREQ       2
 #define DSR_OPT_RERR       3
 #define DSR_OPT_PREV_HOP   5
+#define DSR_OPT_RREQ_TRGS  6	/* Extension: extra RREQ targets. The two
+				 * high bits are zero, so nodes that do not
+				 * know it skip it. */
 #define DSR_OPT_ACK       32
 #define DSR_OPT_SRT       96
 #define DSR_OPT_TIMEOUT  128
@@ -16,6 +16,7 @@
 
 #include "debug.h"
 #include "dsr-opt.h"
+#include "dsr-srt.h"
 #include "dsr.h"
 
 char *dsr_pkt_alloc_opts(struct dsr_pkt *dp, int len)
@@ -114,7 +115,7 @@ struct dsr_pkt *dsr_pkt_alloc(Packet * p)
 			
 			opth = HDR_DSRUU(p);
 
-			dsr_opts_len = opth->p_len + DSR_OPT_HDR_LEN;
+			dsr_opts_len = DSR_OPTS_LEN(opth);
 
 			if (!dsr_pkt_alloc_opts(dp, dsr_opts_len)) {
 				kfree(dp);
@@ -172,7 +173,7 @@ struct dsr_pkt *dsr_pkt_alloc(struct sk_buff *skb)
 			opth = (struct dsr_opt_hdr *)(dp->nh.raw + (dp->nh.iph->ihl << 2));
 		
 
-			dsr_opts_len = ntohs(opth->p_len) + DSR_OPT_HDR_LEN;
+			dsr_opts_len = DSR_OPTS_LEN(opth);
 
 			if (!dsr_pkt_alloc_opts(dp, dsr_opts_len)) {
 				kfree(dp);
@@ -212,7 +213,7 @@ void dsr_pkt_free(struct dsr_pkt *dp)
 	dsr_pkt_free_opts(dp);
 
 	if (dp->srt)
-		kfree(dp->srt);
+		dsr_srt_put(dp->srt);
 
 	kfree(dp);
 
@@ -21,6 +21,38 @@
 #include "dsr-ack.h"
 #include "link-cache.h"
 #include "maint-buf.h"
+#include "timer.h"
+#include "dsr-flow.h"
+
+#define RERR_TBL_MAX_LEN 32
+
+#ifdef __KERNEL__
+static TBL(rerr_tbl, RERR_TBL_MAX_LEN);
+static DSRUUTimer rerr_tbl_timer;
+static struct rerr_recent rerr_recent;	/* Protected by the rerr_tbl lock */
+#endif
+
+/* Link breaks waiting to be reported to one error destination. Breaks seen
+ * within RERRCoalesceWindow of the first one are sent in the same packet,
+ * and repeated reports of the same link are dropped. */
+struct rerr_entry {
+	list_t l;
+	struct in_addr dst;
+	int num_links;
+	struct rerr_link links[RERR_MAX_LINKS];
+	struct timeval expires;
+};
+
+static inline int crit_rerr_dst(void *pos, void *data)
+{
+	struct rerr_entry *e = (struct rerr_entry *)pos;
+	struct in_addr *dst = (struct in_addr *)data;
+
+	if (e->dst.s_addr == dst->s_addr)
+		return 1;
+
+	return 0;
+}
 
 static struct dsr_rerr_opt *dsr_rerr_opt_add(char *buf, int len,
 					     int err_type,
@@ -55,6 +87,13 @@ static struct dsr_rerr_opt *dsr_rerr_opt_add(char *buf, int len,
 		break;
 	case OPTION_NOT_SUPPORTED:
 		break;
+	case UNKNOWN_FLOW:
+		/* The flow destination, the caller adds the flow id */
+		if (len < (int)(DSR_RERR_HDR_LEN + DSR_RERR_FLOW_INFO_LEN))
+			return NULL;
+		rerr_opt->length += DSR_RERR_FLOW_INFO_LEN;
+		memcpy(rerr_opt->info, &unreach_addr, sizeof(struct in_addr));
+		break;
 	}
 
 	return rerr_opt;
@@ -62,26 +101,53 @@ static struct dsr_rerr_opt *dsr_rerr_opt_add(char *buf, int len,
 
 int NSCLASS dsr_rerr_send(struct dsr_pkt *dp_trigg, struct in_addr unr_addr)
 {
-	struct dsr_pkt *dp;
-	struct dsr_rerr_opt *rerr_opt;
-	struct in_addr dst, err_src, err_dst, myaddr;
-	char *buf;
-	int n, len, i;
+	struct rerr_link link;
+	struct in_addr dst, myaddr;
 
 	myaddr = my_addr();
 
 	if (!dp_trigg || dp_trigg->src.s_addr == myaddr.s_addr)
 		return -1;
 
-	if (!dp_trigg->srt_opt) {
+	/* Packets sent on a flow are never salvaged, so the error goes back
+	 * to the source */
+	if (dp_trigg->dh.opth && dp_trigg->dh.opth->f) {
+		dst = dp_trigg->src;
+		link.salv = 0;
+	} else if (!dp_trigg->srt_opt) {
 		LOG_DBG("Could not find source route option\n");
 		return -1;
+	} else {
+		if (dp_trigg->srt_opt->salv == 0)
+			dst = dp_trigg->src;
+		else
+			dst.s_addr = dp_trigg->srt_opt->addrs[1];
+
+		link.salv = dp_trigg->srt_opt->salv;
 	}
+	link.unr_addr = unr_addr;
 
-	if (dp_trigg->srt_opt->salv == 0)
-		dst = dp_trigg->src;
-	else
-		dst.s_addr = dp_trigg->srt_opt->addrs[1];
+	/* RERR and ACK options of the trigger have to go out with its own
+	 * error, so those are not coalesced */
+	if (!ConfVal(RERRCoalesceWindow) ||
+	    dp_trigg->num_rerr_opts || dp_trigg->num_ack_opts)
+		return dsr_rerr_xmit(dst, &link, 1, dp_trigg);
+
+	return rerr_tbl_add(dst, &link);
+}
+
+/* Send one RERR packet to dst reporting n broken links. Options carried by
+ * the triggering packet, if any, are appended. */
+int NSCLASS dsr_rerr_xmit(struct in_addr dst, struct rerr_link *links, int n,
+			  struct dsr_pkt *dp_trigg)
+{
+	struct dsr_pkt *dp;
+	struct dsr_rerr_opt *rerr_opt = NULL;
+	struct in_addr myaddr;
+	char *buf;
+	int len, i;
+
+	myaddr = my_addr();
 
 	dp = dsr_pkt_alloc(NULL);
 
@@ -94,13 +160,17 @@ int NSCLASS dsr_rerr_send(struct dsr_pkt *dp_trigg, struct in_addr unr_addr)
 
 	if (!dp->srt) {
 		LOG_DBG("No source route to %s\n", print_ip(dst));
-		return -1;
+		goto out_err;
 	}
 
 	len = DSR_OPT_HDR_LEN + DSR_SRT_OPT_LEN(dp->srt) + 
-		(DSR_RERR_HDR_LEN + 4) + 
-		DSR_ACK_HDR_LEN * dp_trigg->num_ack_opts;
-	
+		(DSR_RERR_HDR_LEN + 4) * n;
+
+	if (!dp_trigg)
+		goto build;
+
+	len += DSR_ACK_HDR_LEN * dp_trigg->num_ack_opts;
+
 	/* Also count in RERR opts in trigger packet */
 	for (i = 0; i < dp_trigg->num_rerr_opts; i++) {
 		if (dp_trigg->rerr_opt[i]->salv > ConfVal(MAX_SALVAGE_COUNT))
@@ -108,12 +178,13 @@ int NSCLASS dsr_rerr_send(struct dsr_pkt *dp_trigg, struct in_addr unr_addr)
 
 		len += (dp_trigg->rerr_opt[i]->length + 2);
 	}
-	
+
+ build:
 	LOG_DBG("opt_len=%d SR: %s\n", len, print_srt(dp->srt));
-	n = dp->srt->laddrs / sizeof(struct in_addr);
 	dp->src = myaddr;
 	dp->dst = dst;
-	dp->nxt_hop = dsr_srt_next_hop(dp->srt, n);
+	dp->nxt_hop = dsr_srt_next_hop(dp->srt,
+				       dp->srt->laddrs / sizeof(struct in_addr));
 
 	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
 				  IP_HDR_LEN + len, IPPROTO_DSR, IPDEFTTL);
@@ -148,15 +219,24 @@ int NSCLASS dsr_rerr_send(struct dsr_pkt *dp_trigg, struct in_addr unr_addr)
 	buf += DSR_SRT_OPT_LEN(dp->srt);
 	len -= DSR_SRT_OPT_LEN(dp->srt);
 
-	rerr_opt = dsr_rerr_opt_add(buf, len, NODE_UNREACHABLE, dp->src, 
-				    dp->dst, unr_addr, 
-				    dp_trigg->srt_opt->salv);
+	for (i = 0; i < n; i++) {
+		rerr_opt = dsr_rerr_opt_add(buf, len, NODE_UNREACHABLE, dp->src,
+					    dp->dst, links[i].unr_addr,
+					    links[i].salv);
 
-	if (!rerr_opt)
-		goto out_err;
+		if (!rerr_opt)
+			goto out_err;
+
+		buf += (rerr_opt->length + 2);
+		len -= (rerr_opt->length + 2);
+
+		LOG_DBG("Send RERR err_src %s err_dst %s unr_dst %s\n",
+			print_ip(dp->src), print_ip(dp->dst),
+			print_ip(links[i].unr_addr));
+	}
 
-	buf += (rerr_opt->length + 2);
-	len -= (rerr_opt->length + 2);
+	if (!dp_trigg)
+		goto xmit;
 
 	/* Add old RERR options */
 	for (i = 0; i < dp_trigg->num_rerr_opts; i++) {
@@ -183,14 +263,7 @@ int NSCLASS dsr_rerr_send(struct dsr_pkt *dp_trigg, struct in_addr unr_addr)
 		buf += (dp_trigg->ack_opt[i]->length + 2);
 	}
 
-	err_src.s_addr = rerr_opt->err_src;
-	err_dst.s_addr = rerr_opt->err_dst;
-
-	LOG_DBG("Send RERR err_src %s err_dst %s unr_dst %s\n",
-	      print_ip(err_src),
-	      print_ip(err_dst), 
-	      print_ip(*((struct in_addr *)rerr_opt->info)));
-
+ xmit:
 	XMIT(dp);
 
 	return 0;
@@ -203,14 +276,112 @@ int NSCLASS dsr_rerr_send(struct dsr_pkt *dp_trigg, struct in_addr unr_addr)
 
 }
 
+/* Tell the source of a packet that we have no state for the flow it was
+ * sent on */
+int NSCLASS dsr_rerr_flow_send(struct dsr_pkt *dp_trigg)
+{
+	struct dsr_pkt *dp;
+	struct dsr_rerr_opt *rerr_opt;
+	struct in_addr myaddr;
+	u_int16_t id;
+	char *buf;
+	int len;
+
+	myaddr = my_addr();
+
+	if (!dp_trigg || !dp_trigg->dh.opth || !dp_trigg->dh.opth->f ||
+	    dp_trigg->src.s_addr == myaddr.s_addr)
+		return -1;
+
+	dp = dsr_pkt_alloc(NULL);
+
+	if (!dp) {
+		LOG_DBG("Could not allocate DSR packet\n");
+		return -1;
+	}
+
+	dp->src = myaddr;
+	dp->dst = dp_trigg->src;
+	dp->srt = dsr_rtc_find(dp->src, dp->dst);
+
+	if (!dp->srt) {
+		LOG_DBG("No source route to %s\n", print_ip(dp->dst));
+		goto out_err;
+	}
+
+	len = DSR_OPT_HDR_LEN + DSR_SRT_OPT_LEN(dp->srt) +
+		DSR_RERR_HDR_LEN + DSR_RERR_FLOW_INFO_LEN;
+
+	dp->nxt_hop = dsr_srt_next_hop(dp->srt,
+				       dp->srt->laddrs / sizeof(struct in_addr));
+
+	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
+				  IP_HDR_LEN + len, IPPROTO_DSR, IPDEFTTL);
+
+	if (!dp->nh.iph) {
+		LOG_DBG("Could not create IP header\n");
+		goto out_err;
+	}
+
+	buf = dsr_pkt_alloc_opts(dp, len);
+
+	if (!buf)
+		goto out_err;
+
+	dp->dh.opth = dsr_opt_hdr_add(buf, len, DSR_NO_NEXT_HDR_TYPE);
+
+	if (!dp->dh.opth) {
+		LOG_DBG("Could not create DSR options header\n");
+		goto out_err;
+	}
+
+	buf += DSR_OPT_HDR_LEN;
+	len -= DSR_OPT_HDR_LEN;
+
+	dp->srt_opt = dsr_srt_opt_add(buf, len, 0, 0, dp->srt);
+
+	if (!dp->srt_opt) {
+		LOG_DBG("Could not create Source Route option header\n");
+		goto out_err;
+	}
+
+	buf += DSR_SRT_OPT_LEN(dp->srt);
+	len -= DSR_SRT_OPT_LEN(dp->srt);
+
+	rerr_opt = dsr_rerr_opt_add(buf, len, UNKNOWN_FLOW, dp->src, dp->dst,
+				    dp_trigg->dst, 0);
+
+	if (!rerr_opt)
+		goto out_err;
+
+	/* The flow id is carried as is */
+	id = dp_trigg->dh.opth->p_len;
+	memcpy(rerr_opt->info + sizeof(struct in_addr), &id, sizeof(id));
+
+	LOG_DBG("Send RERR unknown flow %u to %s\n", ntohs(id),
+		print_ip(dp->dst));
+
+	XMIT(dp);
+
+	return 0;
+
+ out_err:
+	dsr_pkt_free(dp);
+
+	return -1;
+}
+
 int NSCLASS dsr_rerr_opt_recv(struct dsr_pkt *dp, struct dsr_rerr_opt *rerr_opt)
 {
 	struct in_addr err_src, err_dst, unr_addr;
+	u_int16_t id;
 
 	if (!rerr_opt)
 		return -1;
-	
-	dp->rerr_opt[dp->num_rerr_opts++] = rerr_opt;
+
+	/* A coalesced RERR may carry more options than we keep track of */
+	if (dp->num_rerr_opts < MAX_RERR_OPTS)
+		dp->rerr_opt[dp->num_rerr_opts++] = rerr_opt;
 
 	switch (rerr_opt->err_type) {
 	case NODE_UNREACHABLE:
@@ -224,6 +395,10 @@ int NSCLASS dsr_rerr_opt_recv(struct dsr_pkt *dp, struct dsr_rerr_opt *rerr_opt)
 			print_ip(err_dst), 
 			print_ip(unr_addr));
 
+		/* Tell others about the break on our next RREQ */
+		if (dp->dst.s_addr == my_addr().s_addr)
+			rerr_recent_add(err_src, unr_addr);
+
 		/* For now we drop all unacked packets... should probably
 		 * salvage */
 		maint_buf_del_all(err_dst);
@@ -240,7 +415,260 @@ int NSCLASS dsr_rerr_opt_recv(struct dsr_pkt *dp, struct dsr_rerr_opt *rerr_opt)
 	case OPTION_NOT_SUPPORTED:
 		LOG_DBG("OPTION_NOT_SUPPORTED\n");
 		break;
+	case UNKNOWN_FLOW:
+		if (dp->dst.s_addr != my_addr().s_addr ||
+		    rerr_opt->length < DSR_RERR_OPT_LEN + DSR_RERR_FLOW_INFO_LEN)
+			break;
+
+		memcpy(&unr_addr, rerr_opt->info, sizeof(struct in_addr));
+		memcpy(&id, rerr_opt->info + sizeof(struct in_addr),
+		       sizeof(id));
+
+		LOG_DBG("UNKNOWN_FLOW %u to %s\n", ntohs(id),
+			print_ip(unr_addr));
+
+		/* The next packet establishes a new flow */
+		dsr_flow_del(unr_addr, ntohs(id));
+		break;
 	}
 
 	return 0;
 }
+
+/* Queue a link break for dst, merging it with breaks already waiting to be
+ * reported there */
+int NSCLASS rerr_tbl_add(struct in_addr dst, struct rerr_link *link)
+{
+	struct rerr_entry *e;
+	int i;
+
+	write_lock_bh(&rerr_tbl.lock);
+
+	e = (struct rerr_entry *)__tbl_find(&rerr_tbl, &dst, crit_rerr_dst);
+
+	if (e) {
+		for (i = 0; i < e->num_links; i++) {
+			if (e->links[i].unr_addr.s_addr ==
+			    link->unr_addr.s_addr) {
+				LOG_DBG("RERR for %s to %s already pending\n",
+					print_ip(link->unr_addr),
+					print_ip(dst));
+				write_unlock_bh(&rerr_tbl.lock);
+				return 0;
+			}
+		}
+
+		if (e->num_links < RERR_MAX_LINKS) {
+			e->links[e->num_links++] = *link;
+			write_unlock_bh(&rerr_tbl.lock);
+			return 0;
+		}
+
+		/* No room, report this break on its own */
+		write_unlock_bh(&rerr_tbl.lock);
+		return dsr_rerr_xmit(dst, link, 1, NULL);
+	}
+
+	if (TBL_FULL(&rerr_tbl)) {
+		write_unlock_bh(&rerr_tbl.lock);
+		return dsr_rerr_xmit(dst, link, 1, NULL);
+	}
+
+	e = (struct rerr_entry *)kmalloc(sizeof(struct rerr_entry),
+					 GFP_ATOMIC);
+
+	if (!e) {
+		write_unlock_bh(&rerr_tbl.lock);
+		return -1;
+	}
+
+	e->dst = dst;
+	e->num_links = 1;
+	e->links[0] = *link;
+
+	gettime(&e->expires);
+	timeval_add_usecs(&e->expires, ConfValToUsecs(RERRCoalesceWindow));
+
+	/* The window is the same for all, so the table stays in expiry
+	 * order */
+	__tbl_add_tail(&rerr_tbl, &e->l);
+
+	if (!timer_pending(&rerr_tbl_timer))
+		__rerr_tbl_set_timeout();
+
+	write_unlock_bh(&rerr_tbl.lock);
+
+	return 0;
+}
+
+/* Remember a link break reported to us, so that it can be carried on the
+ * RREQs we send next, as suggested in section 8.2.1 of the draft */
+void NSCLASS rerr_recent_add(struct in_addr err_src, struct in_addr unr_addr)
+{
+	struct rerr_recent_link *r = NULL;
+	int i;
+
+	if (!ConfVal(RREQErrorHoldTime))
+		return;
+
+	write_lock_bh(&rerr_tbl.lock);
+
+	for (i = 0; i < RERR_RECENT_MAX; i++) {
+		if (rerr_recent.links[i].err_src.s_addr == err_src.s_addr &&
+		    rerr_recent.links[i].unr_addr.s_addr == unr_addr.s_addr) {
+			r = &rerr_recent.links[i];
+			break;
+		}
+	}
+
+	/* Otherwise overwrite the oldest */
+	if (!r) {
+		r = &rerr_recent.links[rerr_recent.next];
+		rerr_recent.next = (rerr_recent.next + 1) % RERR_RECENT_MAX;
+	}
+
+	r->err_src = err_src;
+	r->unr_addr = unr_addr;
+	gettime(&r->expires);
+	timeval_add_usecs(&r->expires, ConfValToUsecs(RREQErrorHoldTime));
+
+	write_unlock_bh(&rerr_tbl.lock);
+}
+
+/* Copy the recently reported links that have not yet expired */
+int NSCLASS rerr_recent_get(struct rerr_recent_link *links, int max)
+{
+	struct timeval now;
+	int i, n = 0;
+
+	if (!ConfVal(RREQErrorHoldTime))
+		return 0;
+
+	gettime(&now);
+
+	read_lock_bh(&rerr_tbl.lock);
+
+	for (i = 0; i < RERR_RECENT_MAX && n < max; i++)
+		if (timeval_diff(&rerr_recent.links[i].expires, &now) > 0)
+			links[n++] = rerr_recent.links[i];
+
+	read_unlock_bh(&rerr_tbl.lock);
+
+	return n;
+}
+
+/* Write one RERR option per link into buf. Returns the length written, or
+ * -1 if buf is too small. */
+int NSCLASS dsr_rerr_recent_opts_add(char *buf, int len,
+				     struct rerr_recent_link *links, int n)
+{
+	struct dsr_rerr_opt *rerr_opt;
+	int i, tot = 0;
+
+	for (i = 0; i < n; i++) {
+		rerr_opt = dsr_rerr_opt_add(buf + tot, len - tot,
+					    NODE_UNREACHABLE, links[i].err_src,
+					    my_addr(), links[i].unr_addr, 0);
+		if (!rerr_opt)
+			return -1;
+
+		tot += rerr_opt->length + 2;
+	}
+
+	return tot;
+}
+
+/* Remove the links reported in RERR options carried by a RREQ from the
+ * cache, so that we do not offer them in a cached reply */
+void NSCLASS dsr_rerr_opts_purge(struct dsr_pkt *dp)
+{
+	struct dsr_rerr_opt *rerr_opt;
+	struct dsr_opt *dopt;
+	struct in_addr err_src, unr_addr;
+	int dsr_len, l;
+
+	dsr_len = dsr_pkt_opts_len(dp);
+
+	l = DSR_OPT_HDR_LEN;
+	dopt = DSR_GET_OPT(dp->dh.opth);
+
+	while (l < dsr_len && (dsr_len - l) > 2) {
+		if (dopt->type == DSR_OPT_RERR) {
+			rerr_opt = (struct dsr_rerr_opt *)dopt;
+
+			if (rerr_opt->err_type == NODE_UNREACHABLE) {
+				err_src.s_addr = rerr_opt->err_src;
+				memcpy(&unr_addr, rerr_opt->info,
+				       sizeof(struct in_addr));
+
+				LOG_DBG("RREQ reports %s->%s broken\n",
+					print_ip(err_src), print_ip(unr_addr));
+
+				lc_link_del(err_src, unr_addr);
+			}
+		}
+		l += dopt->length + 2;
+		dopt = DSR_GET_NEXT_OPT(dopt);
+	}
+}
+
+void NSCLASS rerr_tbl_timeout(unsigned long data)
+{
+	TBL(due, RERR_TBL_MAX_LEN);
+	struct rerr_entry *e;
+	struct timeval now;
+
+	gettime(&now);
+
+	write_lock_bh(&rerr_tbl.lock);
+
+	while (!TBL_EMPTY(&rerr_tbl)) {
+		e = (struct rerr_entry *)TBL_FIRST(&rerr_tbl);
+
+		if (timeval_diff(&e->expires, &now) > 0)
+			break;
+
+		__tbl_detach(&rerr_tbl, &e->l);
+		__tbl_add_tail(&due, &e->l);
+	}
+
+	if (!TBL_EMPTY(&rerr_tbl))
+		__rerr_tbl_set_timeout();
+
+	write_unlock_bh(&rerr_tbl.lock);
+
+	while ((e = (struct rerr_entry *)__tbl_detach_first(&due))) {
+		dsr_rerr_xmit(e->dst, e->links, e->num_links, NULL);
+		kfree(e);
+	}
+}
+
+void NSCLASS __rerr_tbl_set_timeout(void)
+{
+	struct rerr_entry *e;
+
+	e = (struct rerr_entry *)TBL_FIRST(&rerr_tbl);
+
+	rerr_tbl_timer.function = &NSCLASS rerr_tbl_timeout;
+	rerr_tbl_timer.data = 0;
+
+	set_timer(&rerr_tbl_timer, &e->expires);
+}
+
+int __init NSCLASS rerr_tbl_init(void)
+{
+	INIT_TBL(&rerr_tbl, RERR_TBL_MAX_LEN);
+
+	memset(&rerr_recent, 0, sizeof(rerr_recent));
+
+	init_timer(&rerr_tbl_timer);
+
+	return 0;
+}
+
+void __exit NSCLASS rerr_tbl_cleanup(void)
+{
+	del_timer_sync(&rerr_tbl_timer);
+
+	tbl_flush(&rerr_tbl, NULL);
+}
@@ -44,13 +44,56 @@ struct node_unreach_info {
 #define NODE_UNREACHABLE          1
 #define FLOW_STATE_NOT_SUPPORTED  2
 #define OPTION_NOT_SUPPORTED      3
+#define UNKNOWN_FLOW            129
+
+/* Info of an UNKNOWN_FLOW error, the flow id is in network byte order and
+ * follows the destination */
+#define DSR_RERR_FLOW_INFO_LEN    6
+
+/* Max unreachable links reported in one coalesced RERR */
+#define RERR_MAX_LINKS 8
+
+/* A broken link from this node to unr_addr */
+struct rerr_link {
+	struct in_addr unr_addr;
+	int salv;
+};
+
+/* Max links from received RERRs that are carried on our RREQs */
+#define RERR_RECENT_MAX 4
+
+#define DSR_RERR_RECENT_LEN(n) ((n) * (DSR_RERR_HDR_LEN + sizeof(struct in_addr)))
+
+/* A broken link reported to us, from err_src to unr_addr */
+struct rerr_recent_link {
+	struct in_addr err_src, unr_addr;
+	struct timeval expires;
+};
+
+struct rerr_recent {
+	int next;
+	struct rerr_recent_link links[RERR_RECENT_MAX];
+};
 
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
 
 int dsr_rerr_send(struct dsr_pkt *dp_trigg, struct in_addr unr_addr);
+int dsr_rerr_xmit(struct in_addr dst, struct rerr_link *links, int n,
+		  struct dsr_pkt *dp_trigg);
+int dsr_rerr_flow_send(struct dsr_pkt *dp_trigg);
 int dsr_rerr_opt_recv(struct dsr_pkt *dp, struct dsr_rerr_opt *dsr_rerr_opt);
+int rerr_tbl_add(struct in_addr dst, struct rerr_link *link);
+void rerr_recent_add(struct in_addr err_src, struct in_addr unr_addr);
+int rerr_recent_get(struct rerr_recent_link *links, int max);
+int dsr_rerr_recent_opts_add(char *buf, int len,
+			     struct rerr_recent_link *links, int n);
+void dsr_rerr_opts_purge(struct dsr_pkt *dp);
+void rerr_tbl_timeout(unsigned long data);
+void __rerr_tbl_set_timeout(void);
+int rerr_tbl_init(void);
+void rerr_tbl_cleanup(void);
 
 #endif				/* NO_DECLS */
 
@@ -29,80 +29,173 @@
 #include "send-buf.h"
 #include "timer.h"
 
-#define GRAT_RREP_TBL_MAX_LEN 64
+#define GRAT_RREP_TBL_MAX_LEN 256
 #define GRAT_REPLY_HOLDOFF 1
+#define RREP_DELAY_TBL_MAX_LEN 32
 
 #ifdef __KERNEL__
 #define GRAT_RREP_TBL_PROC_NAME "dsr_grat_rrep_tbl"
 static TBL(grat_rrep_tbl, GRAT_RREP_TBL_MAX_LEN);
+static struct grat_rrep_entry *grat_rrep_hash[GRAT_RREP_HASH_SIZE];
 DSRUUTimer grat_rrep_tbl_timer;
+static TBL(rrep_delay_tbl, RREP_DELAY_TBL_MAX_LEN);
+static DSRUUTimer rrep_delay_timer;
 #endif
 
+/* Entries all live for GratReplyHoldOff, so the table list, in insertion
+ * order, is also in expiry order. Lookups go through the hash. */
 struct grat_rrep_entry {
 	list_t l;
+	struct grat_rrep_entry *hnext;	/* Next in hash chain */
 	struct in_addr src, prev_hop;
 	struct timeval expires;
 };
 
-struct grat_rrep_query {
-	struct in_addr *src, *prev_hop;
+/* A cached reply waiting for its turn. Cancelled if the initiator is heard
+ * using a route at least as short. */
+struct rrep_delay_entry {
+	list_t l;
+	struct in_addr initiator, target;
+	int hops;		/* Length of the route offered */
+	struct dsr_srt *srt;	/* Route back to the initiator */
+	struct dsr_srt *srt_to_me;	/* The route offered */
+	struct timeval expires;
+};
+
+struct rrep_delay_query {
+	struct in_addr initiator, target;
+	int hops;
 };
 
-static inline int crit_query(void *pos, void *query)
+static inline unsigned int grat_rrep_hash_fn(struct in_addr src,
+					     struct in_addr prev_hop)
+{
+	unsigned int h = src.s_addr ^ prev_hop.s_addr;
+
+	h ^= (h >> 16);
+	h ^= (h >> 8);
+
+	return h & (GRAT_RREP_HASH_SIZE - 1);
+}
+
+static inline int crit_delay_expires(void *pos, void *data)
 {
-	struct grat_rrep_entry *p = (struct grat_rrep_entry *)pos;
-	struct grat_rrep_query *q = (struct grat_rrep_query *)query;
+	struct rrep_delay_entry *p = (struct rrep_delay_entry *)pos;
+	struct rrep_delay_entry *e = (struct rrep_delay_entry *)data;
 
-	if (p->src.s_addr == q->src->s_addr &&
-	    p->prev_hop.s_addr == q->prev_hop->s_addr)
+	if (timeval_diff(&p->expires, &e->expires) > 0)
 		return 1;
+
 	return 0;
 }
-static inline int crit_time(void *pos, void *time)
+
+static inline int crit_delay_query(void *pos, void *query)
 {
-	struct grat_rrep_entry *p = (struct grat_rrep_entry *)pos;
-	struct timeval *t = (struct timeval *)time;
+	struct rrep_delay_entry *p = (struct rrep_delay_entry *)pos;
+	struct rrep_delay_query *q = (struct rrep_delay_query *)query;
 
-	if (timeval_diff(&p->expires, t) < 0)
+	if (p->initiator.s_addr == q->initiator.s_addr &&
+	    p->target.s_addr == q->target.s_addr && q->hops <= p->hops)
 		return 1;
 
 	return 0;
 }
 
-void NSCLASS grat_rrep_tbl_timeout(unsigned long data)
+static void rrep_delay_entry_free(struct rrep_delay_entry *e)
 {
-	struct grat_rrep_entry *e =
-	    (struct grat_rrep_entry *)tbl_detach_first(&grat_rrep_tbl);
-
+	dsr_srt_put(e->srt);
+	dsr_srt_put(e->srt_to_me);
 	kfree(e);
+}
 
-	if (tbl_empty(&grat_rrep_tbl))
-		return;
+/* Must be called with the grat_rrep_tbl lock held */
+struct grat_rrep_entry *NSCLASS __grat_rrep_tbl_find(struct in_addr src,
+						     struct in_addr prev_hop)
+{
+	struct grat_rrep_entry *e;
 
-	read_lock_bh(&grat_rrep_tbl.lock);
+	e = grat_rrep_hash[grat_rrep_hash_fn(src, prev_hop)];
+
+	for (; e; e = e->hnext)
+		if (e->src.s_addr == src.s_addr &&
+		    e->prev_hop.s_addr == prev_hop.s_addr)
+			return e;
+
+	return NULL;
+}
+
+/* Unhash, remove and free an entry. Must be called with the grat_rrep_tbl
+ * lock held */
+void NSCLASS __grat_rrep_tbl_del(struct grat_rrep_entry *e)
+{
+	struct grat_rrep_entry **pp;
+
+	pp = &grat_rrep_hash[grat_rrep_hash_fn(e->src, e->prev_hop)];
+
+	for (; *pp; pp = &(*pp)->hnext)
+		if (*pp == e) {
+			*pp = e->hnext;
+			break;
+		}
+
+	__tbl_del(&grat_rrep_tbl, &e->l);
+}
+
+void NSCLASS __grat_rrep_tbl_set_timeout(void)
+{
+	struct grat_rrep_entry *e;
 
 	e = (struct grat_rrep_entry *)TBL_FIRST(&grat_rrep_tbl);
 
 	grat_rrep_tbl_timer.function = &NSCLASS grat_rrep_tbl_timeout;
+	grat_rrep_tbl_timer.data = 0;
 
 	set_timer(&grat_rrep_tbl_timer, &e->expires);
+}
 
-	read_unlock_bh(&grat_rrep_tbl.lock);
+void NSCLASS grat_rrep_tbl_timeout(unsigned long data)
+{
+	struct grat_rrep_entry *e;
+	struct timeval now;
+
+	gettime(&now);
+
+	write_lock_bh(&grat_rrep_tbl.lock);
+
+	while (!TBL_EMPTY(&grat_rrep_tbl)) {
+		e = (struct grat_rrep_entry *)TBL_FIRST(&grat_rrep_tbl);
+
+		if (timeval_diff(&e->expires, &now) > 0)
+			break;
+
+		__grat_rrep_tbl_del(e);
+	}
+
+	if (!TBL_EMPTY(&grat_rrep_tbl))
+		__grat_rrep_tbl_set_timeout();
+
+	write_unlock_bh(&grat_rrep_tbl.lock);
 }
 
 int NSCLASS grat_rrep_tbl_add(struct in_addr src, struct in_addr prev_hop)
 {
-	struct grat_rrep_query q = { &src, &prev_hop };
 	struct grat_rrep_entry *e;
+	unsigned int h;
+
+	write_lock_bh(&grat_rrep_tbl.lock);
 
-	if (in_tbl(&grat_rrep_tbl, &q, crit_query))
+	if (__grat_rrep_tbl_find(src, prev_hop)) {
+		write_unlock_bh(&grat_rrep_tbl.lock);
 		return 0;
+	}
 
 	e = (struct grat_rrep_entry *)kmalloc(sizeof(struct grat_rrep_entry),
 					      GFP_ATOMIC);
 
-	if (!e)
+	if (!e) {
+		write_unlock_bh(&grat_rrep_tbl.lock);
 		return -1;
+	}
 
 	e->src = src;
 	e->prev_hop = prev_hop;
@@ -110,29 +203,34 @@ int NSCLASS grat_rrep_tbl_add(struct in_addr src, struct in_addr prev_hop)
 
 	timeval_add_usecs(&e->expires, ConfValToUsecs(GratReplyHoldOff));
 
-	/* Remove timer before we modify the table */
-	if (timer_pending(&grat_rrep_tbl_timer))
-		del_timer_sync(&grat_rrep_tbl_timer);
+	/* Make room by expiring the oldest entry early */
+	if (TBL_FULL(&grat_rrep_tbl))
+		__grat_rrep_tbl_del((struct grat_rrep_entry *)
+				    TBL_FIRST(&grat_rrep_tbl));
 
-	if (tbl_add(&grat_rrep_tbl, &e->l, crit_time)) {
+	__tbl_add_tail(&grat_rrep_tbl, &e->l);
 
-		read_lock_bh(&grat_rrep_tbl.lock);
-		e = (struct grat_rrep_entry *)TBL_FIRST(&grat_rrep_tbl);
+	h = grat_rrep_hash_fn(src, prev_hop);
+	e->hnext = grat_rrep_hash[h];
+	grat_rrep_hash[h] = e;
+
+	if (!timer_pending(&grat_rrep_tbl_timer))
+		__grat_rrep_tbl_set_timeout();
+
+	write_unlock_bh(&grat_rrep_tbl.lock);
 
-		grat_rrep_tbl_timer.function = &NSCLASS grat_rrep_tbl_timeout;
-		set_timer(&grat_rrep_tbl_timer, &e->expires);
-		read_unlock_bh(&grat_rrep_tbl.lock);
-	}
 	return 1;
 }
 
 int NSCLASS grat_rrep_tbl_find(struct in_addr src, struct in_addr prev_hop)
 {
-	struct grat_rrep_query q = { &src, &prev_hop };
+	int res;
 
-	if (in_tbl(&grat_rrep_tbl, &q, crit_query))
-		return 1;
-	return 0;
+	read_lock_bh(&grat_rrep_tbl.lock);
+	res = (__grat_rrep_tbl_find(src, prev_hop) != NULL);
+	read_unlock_bh(&grat_rrep_tbl.lock);
+
+	return res;
 }
 
 #ifdef __KERNEL__
@@ -363,6 +461,148 @@ int NSCLASS dsr_rrep_send(struct dsr_srt *srt, struct dsr_srt *srt_to_me)
 	return -1;
 }
 
+/* Send a cached reply after a delay proportional to the length of the route
+ * offered, as suggested in section 8.2.5 of the draft, so that nodes with
+ * shorter routes reply first. */
+int NSCLASS dsr_rrep_send_delayed(struct dsr_srt *srt,
+				  struct dsr_srt *srt_to_me)
+{
+	struct rrep_delay_entry *e;
+	usecs_t delay;
+
+	if (!srt || !srt_to_me)
+		return -1;
+
+	if (!ConfVal(CachedReplyDelay))
+		return dsr_rrep_send(srt, srt_to_me);
+
+	e = (struct rrep_delay_entry *)kmalloc(sizeof(struct rrep_delay_entry),
+					       GFP_ATOMIC);
+	if (!e)
+		return -1;
+
+	e->initiator = srt_to_me->src;
+	e->target = srt_to_me->dst;
+	e->hops = DSR_SRT_HOPS(srt_to_me);
+	e->srt = dsr_srt_get(srt);
+	e->srt_to_me = dsr_srt_get(srt_to_me);
+
+	/* d = H * (h - 1 + r) */
+	delay = ConfValToUsecs(CachedReplyDelay) * (e->hops - 1) +
+	    random_jitter(ConfValToUsecs(CachedReplyDelay));
+
+	gettime(&e->expires);
+	timeval_add_usecs(&e->expires, delay);
+
+	write_lock_bh(&rrep_delay_tbl.lock);
+
+	if (TBL_FULL(&rrep_delay_tbl)) {
+		write_unlock_bh(&rrep_delay_tbl.lock);
+		rrep_delay_entry_free(e);
+		return dsr_rrep_send(srt, srt_to_me);
+	}
+
+	__tbl_add(&rrep_delay_tbl, &e->l, crit_delay_expires);
+
+	/* Rearm if this is now the first reply due */
+	if (TBL_FIRST(&rrep_delay_tbl) == &e->l)
+		__rrep_delay_tbl_set_timeout();
+
+	write_unlock_bh(&rrep_delay_tbl.lock);
+
+	LOG_DBG("Delaying cached RREP for %s by %lu usecs\n",
+		print_ip(e->target), delay);
+
+	return 0;
+}
+
+/* The initiator has been heard using, or being offered, a route to target
+ * of the given length. Pending replies that are no better are dropped. */
+void NSCLASS rrep_delay_tbl_cancel(struct in_addr initiator,
+				   struct in_addr target, int hops)
+{
+	struct rrep_delay_query q = { initiator, target, hops };
+	struct rrep_delay_entry *e;
+	int n = 0;
+
+	/* Called for every source routed packet, so do not lock when there
+	 * is nothing to cancel */
+	if (!ConfVal(CachedReplyDelay) || TBL_EMPTY(&rrep_delay_tbl))
+		return;
+
+	write_lock_bh(&rrep_delay_tbl.lock);
+
+	while ((e = (struct rrep_delay_entry *)
+		__tbl_find_detach(&rrep_delay_tbl, &q, crit_delay_query))) {
+		LOG_DBG("Cancelling cached RREP for %s to %s\n",
+			print_ip(target), print_ip(initiator));
+		rrep_delay_entry_free(e);
+		n++;
+	}
+
+	if (n && TBL_EMPTY(&rrep_delay_tbl))
+		del_timer(&rrep_delay_timer);
+	else if (n)
+		__rrep_delay_tbl_set_timeout();
+
+	write_unlock_bh(&rrep_delay_tbl.lock);
+}
+
+/* A reply to the initiator has been seen, it offers the route it carries */
+void NSCLASS dsr_rrep_opt_overheard(struct dsr_pkt *dp,
+				    struct dsr_rrep_opt *rrep_opt)
+{
+	struct in_addr target;
+	int n = DSR_RREP_ADDRS_LEN(rrep_opt) / sizeof(struct in_addr);
+
+	target.s_addr = rrep_opt->addrs[n];
+
+	rrep_delay_tbl_cancel(dp->dst, target, n + 1);
+}
+
+void NSCLASS rrep_delay_tbl_timeout(unsigned long data)
+{
+	TBL(due, RREP_DELAY_TBL_MAX_LEN);
+	struct rrep_delay_entry *e;
+	struct timeval now;
+
+	gettime(&now);
+
+	write_lock_bh(&rrep_delay_tbl.lock);
+
+	while (!TBL_EMPTY(&rrep_delay_tbl)) {
+		e = (struct rrep_delay_entry *)TBL_FIRST(&rrep_delay_tbl);
+
+		if (timeval_diff(&e->expires, &now) > 0)
+			break;
+
+		__tbl_detach(&rrep_delay_tbl, &e->l);
+		__tbl_add_tail(&due, &e->l);
+	}
+
+	if (!TBL_EMPTY(&rrep_delay_tbl))
+		__rrep_delay_tbl_set_timeout();
+
+	write_unlock_bh(&rrep_delay_tbl.lock);
+
+	while ((e = (struct rrep_delay_entry *)__tbl_detach_first(&due))) {
+		dsr_rrep_send(e->srt, e->srt_to_me);
+		rrep_delay_entry_free(e);
+	}
+}
+
+void NSCLASS __rrep_delay_tbl_set_timeout(void)
+{
+	struct rrep_delay_entry *e;
+
+	e = (struct rrep_delay_entry *)TBL_FIRST(&rrep_delay_tbl);
+
+	rrep_delay_timer.function = &NSCLASS rrep_delay_tbl_timeout;
+	rrep_delay_timer.data = 0;
+
+	set_timer(&rrep_delay_timer, &e->expires);
+}
+
 int NSCLASS dsr_rrep_opt_recv(struct dsr_pkt *dp, struct dsr_rrep_opt *rrep_opt)
 {
 	struct in_addr myaddr, srt_dst;
@@ -430,9 +670,12 @@ int NSCLASS dsr_rrep_opt_recv(struct dsr_pkt *dp, struct dsr_rrep_opt *rrep_opt)
 /* 	} */
 /*  end_add_srt: */
 	/* Remove pending RREQs */
-	rreq_tbl_route_discovery_cancel(rrep_opt_srt->dst);
+	/* Only the originator knows its own distance to the target */
+	rreq_tbl_route_discovery_cancel(rrep_opt_srt->dst,
+					dp->dst.s_addr == myaddr.s_addr ?
+					DSR_SRT_HOPS(rrep_opt_srt) : 0);
 
-	kfree(rrep_opt_srt);
+	dsr_srt_put(rrep_opt_srt);
 
 	if (dp->dst.s_addr == myaddr.s_addr) {
 		/*RREP for this node */
@@ -469,18 +712,38 @@ int __init NSCLASS grat_rrep_tbl_init(void)
 		return -1;
 #endif
 	INIT_TBL(&grat_rrep_tbl, GRAT_RREP_TBL_MAX_LEN);
+	INIT_TBL(&rrep_delay_tbl, RREP_DELAY_TBL_MAX_LEN);
+
+	memset(grat_rrep_hash, 0, sizeof(grat_rrep_hash));
 
 	init_timer(&grat_rrep_tbl_timer);
+	init_timer(&rrep_delay_timer);
 
 	return 0;
 }
 
 void __exit NSCLASS grat_rrep_tbl_cleanup(void)
 {
-	tbl_flush(&grat_rrep_tbl, NULL);
+	struct rrep_delay_entry *e;
 
 	del_timer_sync(&grat_rrep_tbl_timer);
 
+	write_lock_bh(&grat_rrep_tbl.lock);
+	__tbl_flush(&grat_rrep_tbl, NULL);
+	memset(grat_rrep_hash, 0, sizeof(grat_rrep_hash));
+	write_unlock_bh(&grat_rrep_tbl.lock);
+
+	/* The timer handler takes the rrep_delay_tbl lock */
+	del_timer_sync(&rrep_delay_timer);
+
+	write_lock_bh(&rrep_delay_tbl.lock);
+
+	while ((e = (struct rrep_delay_entry *)
+		__tbl_detach_first(&rrep_delay_tbl)))
+		rrep_delay_entry_free(e);
+
+	write_unlock_bh(&rrep_delay_tbl.lock);
+
 #ifdef __KERNEL__
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
 	proc_net_remove(GRAT_RREP_TBL_PROC_NAME);
@@ -34,16 +34,31 @@ struct dsr_rrep_opt {
  * the last source route hop (which is the destination) */
 #define DSR_RREP_ADDRS_LEN(rrep_opt) (rrep_opt->length - 1 - sizeof(struct in_addr))
 
+/* Buckets in the (src, prev_hop) hash of the gratuitous RREP table */
+#define GRAT_RREP_HASH_SIZE 64
+
+struct grat_rrep_entry;
+
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
 
 int dsr_rrep_opt_recv(struct dsr_pkt *dp, struct dsr_rrep_opt *rrep_opt);
 int dsr_rrep_send(struct dsr_srt *srt, struct dsr_srt *srt_to_me);
+int dsr_rrep_send_delayed(struct dsr_srt *srt, struct dsr_srt *srt_to_me);
+void dsr_rrep_opt_overheard(struct dsr_pkt *dp, struct dsr_rrep_opt *rrep_opt);
+void rrep_delay_tbl_cancel(struct in_addr initiator, struct in_addr target,
+			   int hops);
+void rrep_delay_tbl_timeout(unsigned long data);
+void __rrep_delay_tbl_set_timeout(void);
 
 void grat_rrep_tbl_timeout(unsigned long data);
 int grat_rrep_tbl_add(struct in_addr src, struct in_addr prev_hop);
 int grat_rrep_tbl_find(struct in_addr src, struct in_addr prev_hop);
+struct grat_rrep_entry *__grat_rrep_tbl_find(struct in_addr src,
+					     struct in_addr prev_hop);
+void __grat_rrep_tbl_del(struct grat_rrep_entry *e);
+void __grat_rrep_tbl_set_timeout(void);
 int grat_rrep_tbl_init(void);
 void grat_rrep_tbl_cleanup(void);
 
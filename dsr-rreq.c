@@ -24,6 +24,7 @@
 #include "tbl.h"
 #include "dsr-rrep.h"
 #include "dsr-rreq.h"
+#include "dsr-rerr.h"
 #include "dsr-opt.h"
 #include "link-cache.h"
 #include "send-buf.h"
@@ -34,6 +35,14 @@
 #define RREQ_TBL_PROC_NAME "dsr_rreq_tbl"
 
 static TBL(rreq_tbl, RREQ_TBL_MAX_LEN);
+static struct hlist_head rreq_id_hash[RREQ_ID_HASH_SIZE];
+static TBL(rreq_fwd_tbl, RREQ_FWD_TBL_MAX_LEN);
+static DSRUUTimer rreq_fwd_timer;
+static struct rreq_bucket rreq_bucket;
+static struct rreq_stats rreq_stats;
+static struct rreq_coalesce rreq_coalesce;
+static DSRUUTimer rreq_coalesce_timer;
+static int rreq_diameter;
 static unsigned int rreq_seqno;
 #endif
 
@@ -44,6 +53,19 @@ static unsigned int rreq_seqno;
 #define STATE_IDLE          0
 #define STATE_IN_ROUTE_DISC 1
 
+#define TTL_START 1
+
+/* An id entry is a slot in its initiator's id ring and is also linked into
+ * the global id hash for duplicate lookups. Both are protected by the
+ * rreq_tbl lock. */
+struct id_entry {
+	struct hlist_node node;	/* Must be first */
+	struct in_addr initiator;
+	struct in_addr trg_addr;
+	unsigned short id;
+	struct timeval expires;
+};
+
 struct rreq_tbl_entry {
 	list_t l;
 	int state;
@@ -55,20 +77,43 @@ struct rreq_tbl_entry {
 	struct timeval last_used;
 	usecs_t timeout;
 	unsigned int num_rexmts;
-	struct tbl rreq_id_tbl;
+	int last_hops;		/* Hop count of the last route found, 0 if
+				 * unknown */
+	struct timeval rrep_window;	/* End of the RREP collection window */
+	int rrep_hops;		/* Shortest route in the window so far */
+	struct rreq_bucket bucket;
+	/* Ring of the most recent ids seen from this initiator, oldest at
+	 * ids_first */
+	unsigned int ids_first;
+	unsigned int ids_len;
+	unsigned int ids_max;
+	struct id_entry ids[RREQ_TLB_MAX_ID];
 };
 
-struct id_entry {
-	list_t l;
-	atomic_t refcnt;
-	struct in_addr trg_addr;
-	unsigned short id;
-};
-struct rreq_tbl_query {
-	struct in_addr *initiator;
-	struct in_addr *target;
-	unsigned int *id;
-};
+#define rreq_tbl_entry_id(e, i) (&(e)->ids[((e)->ids_first + (i)) % (e)->ids_max])
+
+static inline unsigned int rreq_id_hash_fn(struct in_addr initiator,
+					   struct in_addr target,
+					   unsigned short id)
+{
+	unsigned int h = initiator.s_addr ^ target.s_addr ^ id;
+
+	h ^= (h >> 16);
+	h ^= (h >> 8);
+
+	return h & (RREQ_ID_HASH_SIZE - 1);
+}
+
+static void rreq_tbl_entry_ids_unhash(struct rreq_tbl_entry *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->ids_len; i++)
+		hlist_del(&rreq_tbl_entry_id(e, i)->node);
+
+	e->ids_first = 0;
+	e->ids_len = 0;
+}
 
 static inline int crit_addr(void *pos, void *data)
 {
@@ -80,23 +125,98 @@ static inline int crit_addr(void *pos, void *data)
 	return 0;
 }
 
-static inline int crit_duplicate(void *pos, void *data)
+/* Look up an (initiator, target, id) triple in the id hash. Must be called
+ * with the rreq_tbl lock held. */
+struct id_entry *NSCLASS __rreq_id_find(struct in_addr initiator,
+					struct in_addr target,
+					unsigned short id)
 {
-	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos;
-	struct rreq_tbl_query *q = (struct rreq_tbl_query *)data;
+	struct hlist_node *pos;
+
+	hlist_for_each(pos, &rreq_id_hash[rreq_id_hash_fn(initiator, target, id)]) {
+		struct id_entry *id_e = (struct id_entry *)pos;
+
+		if (id_e->initiator.s_addr == initiator.s_addr &&
+		    id_e->trg_addr.s_addr == target.s_addr && id_e->id == id)
+			return id_e;
+	}
+	return NULL;
+}
+
+/* Refill a token bucket for the time passed since it was last used and try
+ * to take one token from it. A rate of zero means no limit. */
+static int rreq_bucket_take(struct rreq_bucket *b, unsigned int rate,
+			    unsigned int burst, struct timeval *now)
+{
+	unsigned long max = (burst ? burst : 1) * 1000;
+	unsigned long add;
+	long elapsed;
 
-	if (e->node_addr.s_addr == q->initiator->s_addr) {
-		list_t *p;
+	if (!rate)
+		return 1;
 
-		list_for_each(p, &e->rreq_id_tbl.head) {
-			struct id_entry *id_e = (struct id_entry *)p;
+	elapsed = timeval_diff(now, &b->last);
+
+	if (elapsed > 0) {
+		/* rate tokens per second is rate / 1000 mtokens per usec */
+		if ((unsigned long)elapsed >= max * 1000 / rate) {
+			b->mtokens = max;
+			b->last = *now;
+		} else {
+			add = (unsigned long)elapsed * rate / 1000;
+
+			/* Only move on by the time that became tokens, so
+			 * frequent calls do not lose the remainder */
+			if (add) {
+				b->mtokens += add;
+				timeval_add_usecs(&b->last, add * 1000 / rate);
+			}
+		}
 
-			if (id_e->trg_addr.s_addr == q->target->s_addr &&
-			    id_e->id == *(q->id))
-				return 1;
+		if (b->mtokens > max) {
+			b->mtokens = max;
+			b->last = *now;
 		}
 	}
-	return 0;
+
+	if (b->mtokens < 1000)
+		return 0;
+
+	b->mtokens -= 1000;
+
+	return 1;
+}
+
+static void rreq_bucket_init(struct rreq_bucket *b, unsigned int burst)
+{
+	b->mtokens = (burst ? burst : 1) * 1000;
+	gettime(&b->last);
+}
+
+/* Check the global and the per target token bucket before originating a
+ * RREQ for an entry. Must be called with the rreq_tbl lock held, or with
+ * the entry detached from the table. */
+int NSCLASS __rreq_rate_allow(struct rreq_tbl_entry *e)
+{
+	struct timeval now;
+
+	gettime(&now);
+
+	if (!rreq_bucket_take(&e->bucket, ConfVal(RREQTargetRateLimit),
+			      ConfVal(RREQTargetBurst), &now)) {
+		rreq_stats.throttled_target++;
+		return 0;
+	}
+
+	if (!rreq_bucket_take(&rreq_bucket, ConfVal(RREQRateLimit),
+			      ConfVal(RREQBurst), &now)) {
+		/* Give the target token back */
+		if (ConfVal(RREQTargetRateLimit))
+			e->bucket.mtokens += 1000;
+		rreq_stats.throttled++;
+		return 0;
+	}
+	return 1;
 }
 
 void NSCLASS rreq_tbl_set_max_len(unsigned int max_len)
@@ -106,9 +226,9 @@ void NSCLASS rreq_tbl_set_max_len(unsigned int max_len)
 #ifdef __KERNEL__
 static int rreq_tbl_print(struct tbl *t, char *buf)
 {
-	list_t *pos1, *pos2;
+	list_t *pos1;
+	unsigned int i;
 	int len = 0;
-	int first = 1;
 	struct timeval now;
 
 	gettime(&now);
@@ -123,45 +243,95 @@ static int rreq_tbl_print(struct tbl *t, char *buf)
 		struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos1;
 		struct id_entry *id_e;
 
-		if (TBL_EMPTY(&e->rreq_id_tbl))
+		if (e->ids_len == 0)
 			len +=
 			    sprintf(buf + len, "  %-15s %-6u %-8lu %15s:%s\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
 				    "-", "-");
 		else {
-			id_e = (struct id_entry *)TBL_FIRST(&e->rreq_id_tbl);
+			id_e = rreq_tbl_entry_id(e, 0);
 			len +=
 			    sprintf(buf + len, "  %-15s %-6u %-8lu %15s:%u\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
 				    print_ip(id_e->trg_addr), id_e->id);
 		}
-		list_for_each(pos2, &e->rreq_id_tbl.head) {
-			id_e = (struct id_entry *)pos2;
-			if (!first)
-				len +=
-				    sprintf(buf + len, "%49s:%u\n",
-					    print_ip(id_e->trg_addr), id_e->id);
-			first = 0;
+		for (i = 1; i < e->ids_len; i++) {
+			id_e = rreq_tbl_entry_id(e, i);
+			len +=
+			    sprintf(buf + len, "%49s:%u\n",
+				    print_ip(id_e->trg_addr), id_e->id);
 		}
 	}
 
+	len += sprintf(buf + len,
+		       "\n# Discoveries Sent Rexmts Throttled Throttled(target) Piggybacked Probes\n"
+		       "  %lu %lu %lu %lu %lu %lu %lu\n"
+		       "# Recv Duplicates Forwarded Suppressed\n"
+		       "  %lu %lu %lu %lu\n"
+		       "# WindowReplies Switches HopsSaved\n"
+		       "  %lu %lu %lu\n",
+		       rreq_stats.discoveries, rreq_stats.sent,
+		       rreq_stats.rexmts, rreq_stats.throttled,
+		       rreq_stats.throttled_target, rreq_stats.piggybacked,
+		       rreq_stats.probes, rreq_stats.recv,
+		       rreq_stats.duplicates, rreq_stats.forwarded,
+		       rreq_stats.suppressed, rreq_stats.window_replies,
+		       rreq_stats.route_switches, rreq_stats.hops_saved);
+
 	read_unlock_bh(&t->lock);
 	return len;
 
 }
 #endif /* __KERNEL__ */
 
+/* Track a slowly decaying maximum of the hop counts we see, as an estimate
+ * of the network diameter. */
+void NSCLASS rreq_diameter_update(int hops)
+{
+	if (hops <= 0 || hops > MAXTTL)
+		return;
+
+	if (hops >= rreq_diameter)
+		rreq_diameter = hops;
+	else
+		rreq_diameter -= (rreq_diameter - hops + 7) / 8;
+}
+
+/* Start the ring search just beyond where the target was found last time.
+ * Without history, or for a neighbor, start with a non-propagating
+ * request. */
+static int rreq_initial_ttl(struct rreq_tbl_entry *e)
+{
+	if (e->last_hops <= 1)
+		return TTL_START;
+
+	if (e->last_hops + 1 > MAXTTL)
+		return MAXTTL;
+
+	return e->last_hops + 1;
+}
+
 void NSCLASS rreq_tbl_timeout(unsigned long data)
 {
 	struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)data;
 	struct timeval expires;
+	int allowed, queued;
 
 	if (!e)
 		return;
 
-	tbl_detach(&rreq_tbl, &e->l);
+	write_lock_bh(&rreq_tbl.lock);
+
+	/* Route discovery was cancelled while we waited for the lock */
+	if (e->state != STATE_IN_ROUTE_DISC) {
+		write_unlock_bh(&rreq_tbl.lock);
+		return;
+	}
+	__tbl_detach(&rreq_tbl, &e->l);
+
+	write_unlock_bh(&rreq_tbl.lock);
 
 	LOG_DBG("RREQ Timeout dst=%s timeout=%lu rexmts=%d \n",
                 print_ip(e->node_addr), e->timeout, e->num_rexmts);
@@ -170,12 +340,26 @@ void NSCLASS rreq_tbl_timeout(unsigned long data)
 		LOG_DBG("MAX RREQs reached for %s\n", print_ip(e->node_addr));
 
 		e->state = STATE_IDLE;
+		/* Whatever we knew about the distance is no longer valid */
+		e->last_hops = 0;
 
 		tbl_add_tail(&rreq_tbl, &e->l);
 		return;
 	}
 
+	write_lock_bh(&rreq_tbl.lock);
+	allowed = __rreq_rate_allow(e);
+	write_unlock_bh(&rreq_tbl.lock);
+
+	if (!allowed) {
+		/* Try again later without counting this as a retransmission */
+		LOG_DBG("RREQ for %s rate limited\n", print_ip(e->node_addr));
+		gettime(&e->last_used);
+		goto out;
+	}
+
 	e->num_rexmts++;
+	rreq_stats.rexmts++;
 
 	/* if (e->ttl == 1) */
 /* 		e->timeout = ConfValToUsecs(RequestPeriod);  */
@@ -184,6 +368,11 @@ void NSCLASS rreq_tbl_timeout(unsigned long data)
 
 	e->ttl *= 2;		/* Double TTL */
 
+	/* Once the local probe has failed, skip floods that are unlikely to
+	 * reach the target given the observed network diameter */
+	if (e->ttl < rreq_diameter)
+		e->ttl = rreq_diameter;
+
 	if (e->ttl > MAXTTL)
 		e->ttl = MAXTTL;
 
@@ -192,8 +381,13 @@ void NSCLASS rreq_tbl_timeout(unsigned long data)
 
 	gettime(&e->last_used);
 
-	dsr_rreq_send(e->node_addr, e->ttl);
+	write_lock_bh(&rreq_tbl.lock);
+	queued = __rreq_coalesce_add(e->node_addr, e->ttl);
+	write_unlock_bh(&rreq_tbl.lock);
 
+	if (!queued)
+		dsr_rreq_send(e->node_addr, e->ttl);
+      out:
 	expires = e->last_used;
 	timeval_add_usecs(&expires, e->timeout);
 
@@ -219,6 +413,10 @@ struct rreq_tbl_entry *NSCLASS __rreq_tbl_entry_create(struct in_addr node_addr)
 	atomic_set(&e->refcnt, 1);
 	memset(&e->tx_time, 0, sizeof(struct timeval));;
 	e->num_rexmts = 0;
+	e->last_hops = 0;
+	memset(&e->rrep_window, 0, sizeof(struct timeval));
+	e->rrep_hops = 0;
+	rreq_bucket_init(&e->bucket, ConfVal(RREQTargetBurst));
 #ifdef NS2
 	e->timer = new DSRUUTimer(this, "RREQTblTimer");
 #else
@@ -235,7 +433,12 @@ struct rreq_tbl_entry *NSCLASS __rreq_tbl_entry_create(struct in_addr node_addr)
 	e->timer->function = &NSCLASS rreq_tbl_timeout;
 	e->timer->data = (unsigned long)e;
 
-	INIT_TBL(&e->rreq_id_tbl, ConfVal(RequestTableIds));
+	e->ids_first = 0;
+	e->ids_len = 0;
+	e->ids_max = ConfVal(RequestTableIds);
+
+	if (e->ids_max == 0 || e->ids_max > RREQ_TLB_MAX_ID)
+		e->ids_max = RREQ_TLB_MAX_ID;
 
 	return e;
 }
@@ -244,28 +447,51 @@ struct rreq_tbl_entry *NSCLASS __rreq_tbl_add(struct in_addr node_addr)
 {
 	struct rreq_tbl_entry *e;
 
-	e = __rreq_tbl_entry_create(node_addr);
-
-	if (!e)
-		return NULL;
-
 	if (TBL_FULL(&rreq_tbl)) {
-		struct rreq_tbl_entry *f;
+		struct rreq_tbl_entry *f = NULL;
+		list_t *pos;
+
+		/* Drop the least recently used entry. One whose timer is
+		 * already running cannot be freed here, since the handler
+		 * waits for the lock we hold. */
+		list_for_each(pos, &rreq_tbl.head) {
+			struct rreq_tbl_entry *o = (struct rreq_tbl_entry *)pos;
+
+			if (o->state != STATE_IN_ROUTE_DISC) {
+				f = o;
+				break;
+			}
+#ifdef NS2
+			del_timer(o->timer);
+			f = o;
+			break;
+#else
+			if (del_timer(o->timer)) {
+				f = o;
+				break;
+			}
+#endif
+		}
 
-		f = (struct rreq_tbl_entry *)TBL_FIRST(&rreq_tbl);
+		if (!f)
+			return NULL;
 
 		__tbl_detach(&rreq_tbl, &f->l);
-
-		del_timer_sync(f->timer);
 #ifdef NS2
 		delete f->timer;
 #else
 		kfree(f->timer);
 #endif
-		tbl_flush(&f->rreq_id_tbl, NULL);
+		rreq_tbl_entry_ids_unhash(f);
 
 		kfree(f);
 	}
+
+	e = __rreq_tbl_entry_create(node_addr);
+
+	if (!e)
+		return NULL;
+
 	__tbl_add_tail(&rreq_tbl, &e->l);
 
 	return e;
@@ -299,44 +525,98 @@ rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
 
 	gettime(&e->last_used);
 
-	if (TBL_FULL(&e->rreq_id_tbl))
-		tbl_del_first(&e->rreq_id_tbl);
-
-	id_e = (struct id_entry *)kmalloc(sizeof(struct id_entry), GFP_ATOMIC);
+	/* A stale copy of this id may still be hashed, just renew it */
+	id_e = __rreq_id_find(initiator, target, id);
 
-	if (!id_e) {
-		res = -ENOMEM;
+	if (id_e) {
+		id_e->expires = e->last_used;
+		timeval_add_usecs(&id_e->expires,
+				  ConfValToUsecs(MaxRequestPeriod));
 		goto out;
 	}
 
+	/* Reuse the oldest slot when the ring is full */
+	if (e->ids_len == e->ids_max) {
+		id_e = rreq_tbl_entry_id(e, 0);
+		hlist_del(&id_e->node);
+		e->ids_first = (e->ids_first + 1) % e->ids_max;
+	} else
+		id_e = rreq_tbl_entry_id(e, e->ids_len++);
+
+	id_e->initiator = initiator;
 	id_e->trg_addr = target;
 	id_e->id = id;
+	id_e->expires = e->last_used;
+	timeval_add_usecs(&id_e->expires, ConfValToUsecs(MaxRequestPeriod));
 
-	tbl_add_tail(&e->rreq_id_tbl, &id_e->l);
+	hlist_add_head(&id_e->node,
+		       &rreq_id_hash[rreq_id_hash_fn(initiator, target, id)]);
       out:
 	write_unlock_bh(&rreq_tbl.lock);
 
 	return 1;
 }
 
-int NSCLASS rreq_tbl_route_discovery_cancel(struct in_addr dst)
+/* Stop route discovery for dst. A positive hop count is remembered to pick
+ * the initial TTL of the next discovery for the same target.
+ *
+ * Buffered packets go out on the route of the first reply. Replies arriving
+ * within RREPWindow after it may carry shorter routes, which the link cache
+ * then prefers for the following packets. Such switches are counted here. */
+int NSCLASS rreq_tbl_route_discovery_cancel(struct in_addr dst, int hops)
 {
 	struct rreq_tbl_entry *e;
+	int first;
 
-	e = (struct rreq_tbl_entry *)tbl_find_detach(&rreq_tbl, &dst,
-						     crit_addr);
+	write_lock_bh(&rreq_tbl.lock);
+
+	__rreq_coalesce_del(dst);
 
+	e = (struct rreq_tbl_entry *)__tbl_find_detach(&rreq_tbl, &dst,
+						       crit_addr);
 	if (!e) {
+		write_unlock_bh(&rreq_tbl.lock);
 		LOG_DBG("%s not in RREQ table\n", print_ip(dst));
 		return -1;
 	}
 
-	if (e->state == STATE_IN_ROUTE_DISC)
+	/* A timer handler waiting for the lock sees the state and backs off */
+	first = (e->state == STATE_IN_ROUTE_DISC);
+	e->state = STATE_IDLE;
+
+	write_unlock_bh(&rreq_tbl.lock);
+
+	if (first)
 		del_timer_sync(e->timer);
 
-	e->state = STATE_IDLE;
 	gettime(&e->last_used);
 
+	if (hops > 0 && ConfVal(RREPWindow)) {
+		if (first) {
+			e->rrep_hops = hops;
+			e->rrep_window = e->last_used;
+			timeval_add_usecs(&e->rrep_window,
+					  ConfValToUsecs(RREPWindow));
+		} else if (timeval_diff(&e->rrep_window, &e->last_used) > 0) {
+			rreq_stats.window_replies++;
+
+			if (hops < e->rrep_hops) {
+				LOG_DBG("Shorter route to %s, %d hops\n",
+					print_ip(dst), hops);
+				rreq_stats.route_switches++;
+				rreq_stats.hops_saved += e->rrep_hops - hops;
+				e->rrep_hops = hops;
+			}
+			/* Remember the best route of the window */
+			hops = e->rrep_hops;
+		}
+	}
+
+	if (hops > 0) {
+		e->last_hops = hops;
+		rreq_diameter_update(hops);
+	}
+
 	tbl_add_tail(&rreq_tbl, &e->l);
 
 	return 1;
@@ -345,11 +625,10 @@ int NSCLASS rreq_tbl_route_discovery_cancel(struct in_addr dst)
 int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 {
 	struct rreq_tbl_entry *e;
-	int ttl, res = 0;
+	struct dsr_srt *probe = NULL;
+	int ttl, allowed, piggyback, queued = 0, res = 0;
 	struct timeval expires;
 
-#define	TTL_START 1
-
 	write_lock_bh(&rreq_tbl.lock);
 
 	e = (struct rreq_tbl_entry *)__tbl_find(&rreq_tbl, &target, crit_addr);
@@ -375,11 +654,17 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 	LOG_DBG("Route discovery for %s\n", print_ip(target));
 
 	gettime(&e->last_used);
-	e->ttl = ttl = TTL_START;
+	e->ttl = ttl = rreq_initial_ttl(e);
 	/* The draft does not actually specify how these Request Timeout values
 	 * should be used... ??? I am just guessing here. */
 
-	if (e->ttl == 1)
+	/* A recently broken route may still get us most of the way. The
+	 * timeout falls back to flooding if the probe finds nothing. */
+	if (ConfVal(LocalDiscoveryTTL))
+		probe = lc_srt_find_partial(my_addr(), target,
+					    ConfVal(LocalDiscoveryTTL));
+
+	if (e->ttl == 1 && !probe)
 		e->timeout = ConfValToUsecs(NonpropRequestTimeout);
 	else
 		e->timeout = ConfValToUsecs(RequestPeriod);
@@ -392,9 +677,33 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 
 	set_timer(e->timer, &expires);
 
+	rreq_stats.discoveries++;
+
+	/* When rate limited, the timeout will try again */
+	allowed = __rreq_rate_allow(e);
+
+	if (allowed && !probe)
+		queued = __rreq_coalesce_add(target, ttl);
+
+	/* Data only goes along when history says the first request will
+	 * reach the target */
+	piggyback = ConfVal(RREQPiggybackMaxLen) && e->last_hops > 0;
+
 	write_unlock_bh(&rreq_tbl.lock);
 
-	dsr_rreq_send(target, ttl);
+	if (!allowed)
+		LOG_DBG("RREQ for %s rate limited\n", print_ip(target));
+	else if (probe)
+		dsr_rreq_send_probe(target, probe);
+	else if (queued)
+		;
+	else if (piggyback)
+		dsr_rreq_send_piggyback(target, ttl);
+	else
+		dsr_rreq_send(target, ttl);
+
+	if (probe)
+		dsr_srt_put(probe);
 
 	return 1;
       out:
@@ -403,20 +712,193 @@ int NSCLASS dsr_rreq_route_discovery(struct in_addr target)
 	return res;
 }
 
+/* Ids are remembered for MaxRequestPeriod. An entry that has aged out but
+ * not yet been evicted from its initiator's id list does not count as a
+ * duplicate. */
 int NSCLASS dsr_rreq_duplicate(struct in_addr initiator, struct in_addr target,
 			       unsigned int id)
 {
-	struct {
-		struct in_addr *initiator;
-		struct in_addr *target;
-		unsigned int *id;
-	} d;
+	struct id_entry *id_e;
+	struct timeval now;
+	int res = 0;
+
+	gettime(&now);
+
+	read_lock_bh(&rreq_tbl.lock);
+
+	id_e = __rreq_id_find(initiator, target, (unsigned short)id);
+
+	if (id_e && timeval_diff(&id_e->expires, &now) > 0)
+		res = 1;
+
+	read_unlock_bh(&rreq_tbl.lock);
+
+	return res;
+}
+
+/* Counter-based rebroadcast suppression: A RREQ that should be forwarded is
+ * held for a random time of up to BroadCastJitter. Copies of the same RREQ
+ * overheard in the meantime are counted, and the rebroadcast is cancelled
+ * if the count reaches the threshold, since the neighborhood has then most
+ * likely already been covered. */
+struct rreq_fwd_entry {
+	list_t l;
+	struct dsr_pkt *dp;
+	struct in_addr initiator;
+	struct in_addr target;
+	unsigned short id;
+	unsigned int dups;
+	unsigned int threshold;
+	struct timeval expires;
+};
+
+struct rreq_fwd_query {
+	struct in_addr *initiator;
+	struct in_addr *target;
+	unsigned short id;
+};
+
+static inline int crit_fwd_query(void *pos, void *data)
+{
+	struct rreq_fwd_entry *e = (struct rreq_fwd_entry *)pos;
+	struct rreq_fwd_query *q = (struct rreq_fwd_query *)data;
+
+	if (e->initiator.s_addr == q->initiator->s_addr &&
+	    e->target.s_addr == q->target->s_addr && e->id == q->id)
+		return 1;
+	return 0;
+}
+
+static inline int crit_fwd_expires(void *pos, void *data)
+{
+	struct rreq_fwd_entry *e = (struct rreq_fwd_entry *)pos;
+	struct rreq_fwd_entry *n = (struct rreq_fwd_entry *)data;
+
+	if (timeval_diff(&e->expires, &n->expires) > 0)
+		return 1;
+	return 0;
+}
+
+/* The number of overheard copies that cancels a rebroadcast. In a sparse
+ * neighborhood every neighbor may be needed to carry the flood onwards, so
+ * suppression only kicks in once there are more neighbors than the
+ * configured threshold. Returns 0 when suppression is disabled. */
+unsigned int NSCLASS rreq_fwd_threshold(void)
+{
+	unsigned int threshold = ConfVal(RREQSuppressThreshold);
+	unsigned int neighbors = neigh_tbl_len();
+
+	if (threshold && neighbors <= threshold)
+		threshold = neighbors + 1;
+
+	return threshold;
+}
+
+void NSCLASS rreq_fwd_tbl_timeout(unsigned long data)
+{
+	struct rreq_fwd_entry *e;
+	struct timeval now;
+
+	gettime(&now);
+
+	while (1) {
+		write_lock_bh(&rreq_fwd_tbl.lock);
+
+		e = (struct rreq_fwd_entry *)TBL_FIRST(&rreq_fwd_tbl);
 
-	d.initiator = &initiator;
-	d.target = &target;
-	d.id = &id;
+		if (TBL_EMPTY(&rreq_fwd_tbl) ||
+		    timeval_diff(&e->expires, &now) > 0)
+			break;
 
-	return in_tbl(&rreq_tbl, &d, crit_duplicate);
+		__tbl_detach(&rreq_fwd_tbl, &e->l);
+
+		write_unlock_bh(&rreq_fwd_tbl.lock);
+
+		if (e->dups >= e->threshold) {
+			LOG_DBG("Suppressing RREQ %s->%s id=%u, %u copies heard\n",
+				print_ip(e->initiator), print_ip(e->target),
+				e->id, e->dups);
+			rreq_stats.suppressed++;
+			dsr_pkt_free(e->dp);
+		} else
+			XMIT(e->dp);
+
+		kfree(e);
+	}
+
+	if (!TBL_EMPTY(&rreq_fwd_tbl)) {
+		rreq_fwd_timer.function = &NSCLASS rreq_fwd_tbl_timeout;
+		set_timer(&rreq_fwd_timer, &e->expires);
+	}
+	write_unlock_bh(&rreq_fwd_tbl.lock);
+}
+
+/* Hold a RREQ that is about to be forwarded. Returns 1 if the packet was
+ * queued, 0 if it should be sent right away. */
+int NSCLASS rreq_fwd_tbl_hold(struct dsr_pkt *dp)
+{
+	struct rreq_fwd_entry *e;
+	unsigned int threshold;
+
+	if (!dp || !dp->rreq_opt)
+		return 0;
+
+	threshold = rreq_fwd_threshold();
+
+	if (!threshold)
+		return 0;
+
+	e = (struct rreq_fwd_entry *)kmalloc(sizeof(struct rreq_fwd_entry),
+					     GFP_ATOMIC);
+	if (!e)
+		return 0;
+
+	e->dp = dp;
+	e->initiator = dp->src;
+	e->target.s_addr = dp->rreq_opt->target;
+	e->id = ntohs(dp->rreq_opt->id);
+	e->dups = 0;
+	e->threshold = threshold;
+
+	gettime(&e->expires);
+	timeval_add_usecs(&e->expires,
+			  random_jitter(ConfValToUsecs(BroadCastJitter)));
+
+	/* The hold time replaces the transmit jitter */
+	dp->flags &= ~PKT_XMIT_JITTER;
+
+	write_lock_bh(&rreq_fwd_tbl.lock);
+
+	if (__tbl_add(&rreq_fwd_tbl, &e->l, crit_fwd_expires) < 0) {
+		write_unlock_bh(&rreq_fwd_tbl.lock);
+		kfree(e);
+		return 0;
+	}
+
+	if (tbl_is_first(&rreq_fwd_tbl, e)) {
+		rreq_fwd_timer.function = &NSCLASS rreq_fwd_tbl_timeout;
+		set_timer(&rreq_fwd_timer, &e->expires);
+	}
+	write_unlock_bh(&rreq_fwd_tbl.lock);
+
+	return 1;
+}
+
+/* Count an overheard copy of a RREQ that we are holding */
+void NSCLASS rreq_fwd_tbl_dup(struct in_addr initiator, struct in_addr target,
+			      unsigned short id)
+{
+	struct rreq_fwd_query q = { &initiator, &target, id };
+	struct rreq_fwd_entry *e;
+
+	write_lock_bh(&rreq_fwd_tbl.lock);
+
+	e = (struct rreq_fwd_entry *)__tbl_find(&rreq_fwd_tbl, &q,
+						crit_fwd_query);
+	if (e)
+		e->dups++;
+
+	write_unlock_bh(&rreq_fwd_tbl.lock);
 }
 
 static struct dsr_rreq_opt *dsr_rreq_opt_add(char *buf, unsigned int len,
@@ -438,11 +920,53 @@ static struct dsr_rreq_opt *dsr_rreq_opt_add(char *buf, unsigned int len,
 	return rreq_opt;
 }
 
+static struct dsr_rreq_trgs_opt *dsr_rreq_trgs_opt_add(char *buf,
+						       unsigned int len,
+						       struct in_addr *targets,
+						       int n)
+{
+	struct dsr_rreq_trgs_opt *trgs_opt;
+	int i;
+
+	if (!buf || len < DSR_RREQ_TRGS_HDR_LEN + n * sizeof(u_int32_t))
+		return NULL;
+
+	trgs_opt = (struct dsr_rreq_trgs_opt *)buf;
+
+	trgs_opt->type = DSR_OPT_RREQ_TRGS;
+	trgs_opt->length = 2 + n * sizeof(u_int32_t);
+	trgs_opt->answered = 0;
+
+	for (i = 0; i < n; i++)
+		trgs_opt->targets[i] = targets[i].s_addr;
+
+	return trgs_opt;
+}
+
 int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
 {
+	return dsr_rreq_send_multi(&target, 1, ttl);
+}
+
+/* Send one RREQ for up to RREQ_MAX_TARGETS targets. The first target goes
+ * into the RREQ option itself, the rest into a targets option right after
+ * it. Recently reported link breaks follow as RERR options. */
+int NSCLASS dsr_rreq_send_multi(struct in_addr *targets, int n, int ttl)
+{
+	struct rerr_recent_link errs[RERR_RECENT_MAX];
 	struct dsr_pkt *dp;
 	char *buf;
 	int len = DSR_OPT_HDR_LEN + DSR_RREQ_HDR_LEN;
+	int nerrs;
+
+	if (n < 1 || n > RREQ_MAX_TARGETS)
+		return -1;
+
+	if (n > 1)
+		len += DSR_RREQ_TRGS_HDR_LEN + (n - 1) * sizeof(u_int32_t);
+
+	nerrs = rerr_recent_get(errs, RERR_RECENT_MAX);
+	len += DSR_RERR_RECENT_LEN(nerrs);
 
 	dp = dsr_pkt_alloc(NULL);
 
@@ -476,20 +1000,128 @@ int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
 	buf += DSR_OPT_HDR_LEN;
 	len -= DSR_OPT_HDR_LEN;
 
-	dp->rreq_opt = dsr_rreq_opt_add(buf, len, target, ++rreq_seqno);
+	dp->rreq_opt = dsr_rreq_opt_add(buf, len, targets[0], ++rreq_seqno);
 
 	if (!dp->rreq_opt) {
 		LOG_DBG("Could not create RREQ opt\n");
 		goto out_err;
 	}
+
+	buf += DSR_RREQ_HDR_LEN;
+	len -= DSR_RREQ_HDR_LEN;
+
+	if (n > 1) {
+		if (!dsr_rreq_trgs_opt_add(buf, len, &targets[1], n - 1)) {
+			LOG_DBG("Could not create RREQ targets opt\n");
+			goto out_err;
+		}
+		buf += DSR_RREQ_TRGS_HDR_LEN + (n - 1) * sizeof(u_int32_t);
+		len -= DSR_RREQ_TRGS_HDR_LEN + (n - 1) * sizeof(u_int32_t);
+	}
+
+	if (nerrs && dsr_rerr_recent_opts_add(buf, len, errs, nerrs) < 0) {
+		LOG_DBG("Could not create RERR opts\n");
+		goto out_err;
+	}
+#ifdef NS2
+	LOG_DBG("Sending RREQ src=%s dst=%s target=%s (+%d) ttl=%d iph->saddr()=%d\n",
+                print_ip(dp->src), print_ip(dp->dst), print_ip(targets[0]),
+                n - 1, ttl, dp->nh.iph->saddr());
+#endif
+
+	dp->flags |= PKT_XMIT_JITTER;
+
+	rreq_stats.sent++;
+
+	XMIT(dp);
+
+	return 0;
+
+      out_err:
+	dsr_pkt_free(dp);
+
+	return -1;
+}
+
+/* Send a RREQ for target that carries the first packet buffered for it, if
+ * that packet is small enough. Otherwise send a plain RREQ. */
+int NSCLASS dsr_rreq_send_piggyback(struct in_addr target, int ttl)
+{
+	struct rerr_recent_link errs[RERR_RECENT_MAX];
+	struct dsr_pkt *dp;
+	char *buf;
+	int len = DSR_OPT_HDR_LEN + DSR_RREQ_HDR_LEN;
+	int prot, ip_len, tot_len, nerrs;
+
+	dp = send_buf_dequeue_first(target, ConfVal(RREQPiggybackMaxLen));
+
+	if (!dp)
+		return dsr_rreq_send(target, ttl);
+
+	nerrs = rerr_recent_get(errs, RERR_RECENT_MAX);
+	len += DSR_RERR_RECENT_LEN(nerrs);
+
+	buf = dsr_pkt_alloc_opts(dp, len);
+
+	if (!buf)
+		goto out_err;
+
 #ifdef NS2
-	LOG_DBG("Sending RREQ src=%s dst=%s target=%s ttl=%d iph->saddr()=%d\n",
-                print_ip(dp->src), print_ip(dp->dst), print_ip(target), ttl,
-                dp->nh.iph->saddr());
+	if (dp->p)
+		prot = HDR_CMN(dp->p)->ptype();
+	else
+		prot = PT_NTYPE;
+
+	ip_len = IP_HDR_LEN;
+	tot_len = dp->payload_len + ip_len + len;
+#else
+	prot = dp->nh.iph->protocol;
+	ip_len = (dp->nh.iph->ihl << 2);
+	tot_len = ntohs(dp->nh.iph->tot_len) + len;
 #endif
+	/* The target finds its own address in the RREQ option */
+	dp->dst.s_addr = DSR_BROADCAST;
+	dp->nxt_hop.s_addr = DSR_BROADCAST;
+
+	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, ip_len, tot_len,
+				  IPPROTO_DSR, ttl);
+
+	if (!dp->nh.iph)
+		goto out_err;
+
+	dp->dh.opth = dsr_opt_hdr_add(buf, len, prot);
+
+	if (!dp->dh.opth) {
+		LOG_DBG("Could not create DSR opt header\n");
+		goto out_err;
+	}
+
+	buf += DSR_OPT_HDR_LEN;
+	len -= DSR_OPT_HDR_LEN;
+
+	dp->rreq_opt = dsr_rreq_opt_add(buf, len, target, ++rreq_seqno);
+
+	if (!dp->rreq_opt) {
+		LOG_DBG("Could not create RREQ opt\n");
+		goto out_err;
+	}
+
+	buf += DSR_RREQ_HDR_LEN;
+	len -= DSR_RREQ_HDR_LEN;
+
+	if (nerrs && dsr_rerr_recent_opts_add(buf, len, errs, nerrs) < 0) {
+		LOG_DBG("Could not create RERR opts\n");
+		goto out_err;
+	}
+
+	LOG_DBG("Sending RREQ for %s with %d bytes of data\n",
+		print_ip(target), dp->payload_len);
 
 	dp->flags |= PKT_XMIT_JITTER;
 
+	rreq_stats.sent++;
+	rreq_stats.piggybacked++;
+
 	XMIT(dp);
 
 	return 0;
@@ -500,18 +1132,254 @@ int NSCLASS dsr_rreq_send(struct in_addr target, int ttl)
 	return -1;
 }
 
+/* Send a RREQ for target along the source route srt. The node at the end of
+ * srt starts a local discovery on our behalf, as if the request had reached
+ * it by flooding. The request therefore already lists the hops up to that
+ * node. */
+int NSCLASS dsr_rreq_send_probe(struct in_addr target, struct dsr_srt *srt)
+{
+	struct dsr_pkt *dp;
+	char *buf;
+	int len;
+
+	dp = dsr_pkt_alloc(NULL);
+
+	if (!dp) {
+		LOG_DBG("Could not allocate DSR packet\n");
+		return -1;
+	}
+
+	dp->src = my_addr();
+	dp->dst = srt->dst;
+
+	if (srt->laddrs == 0)
+		dp->nxt_hop = dp->dst;
+	else
+		dp->nxt_hop = srt->addrs[0];
+
+	len = DSR_OPT_HDR_LEN + DSR_SRT_OPT_LEN(srt) + DSR_RREQ_HDR_LEN +
+	    srt->laddrs;
+
+	buf = dsr_pkt_alloc_opts(dp, len);
+
+	if (!buf)
+		goto out_err;
+
+	dp->nh.iph = dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
+				  IP_HDR_LEN + len, IPPROTO_DSR,
+				  DSR_SRT_HOPS(srt));
+
+	if (!dp->nh.iph) {
+		LOG_DBG("Could not create IP header\n");
+		goto out_err;
+	}
+
+	dp->dh.opth = dsr_opt_hdr_add(buf, len, DSR_NO_NEXT_HDR_TYPE);
+
+	if (!dp->dh.opth) {
+		LOG_DBG("Could not create DSR opt header\n");
+		goto out_err;
+	}
+
+	buf += DSR_OPT_HDR_LEN;
+	len -= DSR_OPT_HDR_LEN;
+
+	/* The source route must come first, so that forwarding nodes know
+	 * to leave the RREQ alone */
+	dp->srt_opt = dsr_srt_opt_add(buf, len, 0, 0, srt);
+
+	if (!dp->srt_opt) {
+		LOG_DBG("Could not create Source Route option header\n");
+		goto out_err;
+	}
+
+	buf += DSR_SRT_OPT_LEN(srt);
+	len -= DSR_SRT_OPT_LEN(srt);
+
+	dp->rreq_opt = dsr_rreq_opt_add(buf, len, target, ++rreq_seqno);
+
+	if (!dp->rreq_opt) {
+		LOG_DBG("Could not create RREQ opt\n");
+		goto out_err;
+	}
+
+	memcpy(dp->rreq_opt->addrs, srt->addrs, srt->laddrs);
+	dp->rreq_opt->length += srt->laddrs;
+
+	LOG_DBG("Probing %s for %s\n", print_ip(srt->dst), print_ip(target));
+
+	rreq_stats.sent++;
+	rreq_stats.probes++;
+
+	XMIT(dp);
+
+	return 0;
+
+      out_err:
+	dsr_pkt_free(dp);
+
+	return -1;
+}
+
+/* Turn a probe that reached its end point into an ordinary flooded request
+ * by stripping the source route option. Returns the RREQ option at its new
+ * position. */
+static struct dsr_rreq_opt *dsr_rreq_probe_flood(struct dsr_pkt *dp,
+						 struct dsr_rreq_opt *rreq_opt)
+{
+	char *srt_opt = (char *)dp->srt_opt;
+	char *from = srt_opt + dp->srt_opt->length + 2;
+	int srt_len = from - srt_opt;
+	int opts_end = ntohs(dp->dh.opth->p_len) + 4;
+
+	memmove(srt_opt, from, dp->dh.raw + opts_end - from);
+
+	if ((char *)rreq_opt > srt_opt)
+		rreq_opt = (struct dsr_rreq_opt *)((char *)rreq_opt - srt_len);
+
+	dp->dh.tail -= srt_len;
+	dp->dh.opth->p_len = htons(ntohs(dp->dh.opth->p_len) - srt_len);
+	dp->srt_opt = NULL;
+	dp->rreq_opt = rreq_opt;
+
+	dp->dst.s_addr = DSR_BROADCAST;
+	dp->nxt_hop.s_addr = DSR_BROADCAST;
+#ifdef NS2
+	dp->nh.iph->daddr() = (nsaddr_t) dp->dst.s_addr;
+#else
+	dp->nh.iph->tot_len = htons(ntohs(dp->nh.iph->tot_len) - srt_len);
+#endif
+	return rreq_opt;
+}
+
+/* Queue a RREQ target for the current coalescing window, so that
+ * discoveries started close together share one flood. Must be called with
+ * the rreq_tbl lock held. Returns 1 if queued, 0 if the caller should send
+ * the RREQ itself. */
+int NSCLASS __rreq_coalesce_add(struct in_addr target, int ttl)
+{
+	struct timeval expires;
+	int i;
+
+	if (!ConfVal(RREQCoalesceWindow))
+		return 0;
+
+	for (i = 0; i < rreq_coalesce.n; i++) {
+		if (rreq_coalesce.targets[i].s_addr == target.s_addr)
+			goto out;
+	}
+
+	if (rreq_coalesce.n == RREQ_MAX_TARGETS)
+		return 0;
+
+	rreq_coalesce.targets[rreq_coalesce.n++] = target;
+
+	if (rreq_coalesce.n == 1) {
+		gettime(&expires);
+		timeval_add_usecs(&expires,
+				  ConfValToUsecs(RREQCoalesceWindow));
+		rreq_coalesce_timer.function = &NSCLASS rreq_coalesce_timeout;
+		set_timer(&rreq_coalesce_timer, &expires);
+	}
+      out:
+	if (ttl > rreq_coalesce.ttl)
+		rreq_coalesce.ttl = ttl;
+
+	return 1;
+}
+
+/* Drop a target from the coalescing window, e.g., because a route to it
+ * was found. Must be called with the rreq_tbl lock held. */
+void NSCLASS __rreq_coalesce_del(struct in_addr target)
+{
+	int i;
+
+	for (i = 0; i < rreq_coalesce.n; i++) {
+		if (rreq_coalesce.targets[i].s_addr == target.s_addr) {
+			rreq_coalesce.targets[i] =
+			    rreq_coalesce.targets[--rreq_coalesce.n];
+			break;
+		}
+	}
+}
+
+void NSCLASS rreq_coalesce_timeout(unsigned long data)
+{
+	struct rreq_coalesce c;
+
+	write_lock_bh(&rreq_tbl.lock);
+	c = rreq_coalesce;
+	rreq_coalesce.n = 0;
+	rreq_coalesce.ttl = 0;
+	write_unlock_bh(&rreq_tbl.lock);
+
+	if (c.n > 0)
+		dsr_rreq_send_multi(c.targets, c.n, c.ttl);
+}
+
+/* Answer a RREQ for target from our route cache. Returns 1 if a RREP was
+ * sent. */
+int NSCLASS dsr_rreq_cached_reply(struct dsr_pkt *dp, struct dsr_srt *srt_rev,
+				  struct in_addr target)
+{
+	struct dsr_srt *srt_rc, *srt_cat;
+
+	/* TODO: Check Blacklist */
+	srt_rc = lc_srt_find(my_addr(), target);
+
+	if (!srt_rc)
+		return 0;
+
+	LOG_DBG("Send cached RREP\n");
+
+	srt_cat = dsr_srt_concatenate(dp->srt, srt_rc);
+
+	dsr_srt_put(srt_rc);
+
+	if (!srt_cat) {
+		LOG_DBG("Could not concatenate\n");
+		return 0;
+	}
+
+	LOG_DBG("srt_cat: %s\n", print_srt(srt_cat));
+
+	if (dsr_srt_check_duplicate(srt_cat) > 0) {
+		LOG_DBG("Duplicate address in source route!!!\n");
+		dsr_srt_put(srt_cat);
+		return 0;
+	}
+
+	LOG_DBG("Sending cached RREP for %s to %s\n", print_ip(target),
+		print_ip(dp->src));
+	dsr_rrep_send_delayed(srt_rev, srt_cat);
+
+	dsr_srt_put(srt_cat);
+
+	return 1;
+}
+
 int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 {
 	struct in_addr myaddr;
 	struct in_addr trg;
-	struct dsr_srt *srt_rev, *srt_rc;
+	struct dsr_srt *srt_rev;
+	struct dsr_rreq_trgs_opt *trgs_opt;
 	int action = DSR_PKT_NONE;
-	int i, n;
+	int i, n, ttl, rreq_off, opts_end;
+	int ntrgs = 0, answered = 0, payload, probe, all;
 
 	LOG_DBG("DSR RREQ\n");
 
 	if (!dp || !rreq_opt || dp->flags & PKT_PROMISC_RECV)
 		return DSR_PKT_DROP;
+
+	myaddr = my_addr();
+
+	/* A source routed probe is only processed at its end point */
+	probe = (dp->srt_opt != NULL);
+
+	if (probe && dp->dst.s_addr != myaddr.s_addr)
+		return DSR_PKT_NONE;
 	
 	dp->num_rreq_opts++;
 	
@@ -522,17 +1390,29 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 
 	dp->rreq_opt = rreq_opt;
 
-	myaddr = my_addr();
-	
 	trg.s_addr = rreq_opt->target;
 
+	rreq_stats.recv++;
+
 	if (dsr_rreq_duplicate(dp->src, trg, ntohs(rreq_opt->id))) {
 		LOG_DBG("Duplicate RREQ from %s\n", print_ip(dp->src));
+		rreq_stats.duplicates++;
+		rreq_fwd_tbl_dup(dp->src, trg, ntohs(rreq_opt->id));
 		return DSR_PKT_DROP;
 	}
 
 	rreq_tbl_add_id(dp->src, trg, ntohs(rreq_opt->id));
 
+	/* Forget links the initiator has found broken before looking in
+	 * the cache */
+	if (dp->num_rerr_opts)
+		dsr_rerr_opts_purge(dp);
+
+	/* Replace the source route of a probe with the one accumulated in
+	 * the request */
+	if (dp->srt)
+		dsr_srt_put(dp->srt);
+
 	dp->srt = dsr_srt_new(dp->src, myaddr, DSR_RREQ_ADDRS_LEN(rreq_opt),
 			      (char *)rreq_opt->addrs);
 
@@ -540,6 +1420,10 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 		LOG_DBG("Could not extract source route\n");
 		return DSR_PKT_ERROR;
 	}
+	/* The accumulated route tells us how far away the initiator is */
+	rreq_diameter_update(DSR_RREQ_ADDRS_LEN(rreq_opt) /
+			     sizeof(struct in_addr) + 1);
+
 	LOG_DBG("RREQ target=%s src=%s dst=%s laddrs=%d\n",
                 print_ip(trg), print_ip(dp->src),
                 print_ip(dp->dst), DSR_RREQ_ADDRS_LEN(rreq_opt));
@@ -567,7 +1451,25 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 	/* Send buffered packets */
 	send_buf_set_verdict(SEND_BUF_SEND, srt_rev->dst);
 
-	if (rreq_opt->target == myaddr.s_addr) {
+#ifdef NS2
+	payload = DATA_PACKET(dp->dh.opth->nh) || dp->dh.opth->nh == PT_PING;
+#else
+	payload = dp->payload_len > 0;
+#endif
+	/* Additional targets of a coalesced RREQ */
+	trgs_opt = (struct dsr_rreq_trgs_opt *)dsr_opt_find_opt(dp,
+							      DSR_OPT_RREQ_TRGS);
+	if (trgs_opt) {
+		ntrgs = DSR_RREQ_TRGS_NUM(trgs_opt);
+
+		if (ntrgs > RREQ_MAX_TARGETS - 1)
+			ntrgs = RREQ_MAX_TARGETS - 1;
+
+		answered = ntohs(trgs_opt->answered);
+	}
+	all = (1 << (ntrgs + 1)) - 1;
+
+	if (rreq_opt->target == myaddr.s_addr && !(answered & 1)) {
 
 		LOG_DBG("RREQ OPT for me - Send RREP\n");
 
@@ -579,15 +1481,37 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 		dp->nh.iph->daddr = rreq_opt->target;
 #endif
 		dsr_rrep_send(srt_rev, dp->srt);
-                
+		answered |= 1;
+
+		if (payload) {
+			LOG_DBG("Delivering data piggybacked on RREQ\n");
+			dp->dst = myaddr;
+			action = DSR_PKT_DELIVER;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < ntrgs; i++) {
+		if (trgs_opt->targets[i] == myaddr.s_addr &&
+		    !(answered & (1 << (i + 1)))) {
+			LOG_DBG("RREQ targets opt for me - Send RREP\n");
+			dsr_rrep_send(srt_rev, dp->srt);
+			answered |= (1 << (i + 1));
+		}
+	}
+
+	/* The target itself never forwards the request */
+	if ((answered & all) == all || rreq_opt->target == myaddr.s_addr) {
 		action = DSR_PKT_NONE;
 		goto out;
-	} 
-	
+	}
+
 	n = DSR_RREQ_ADDRS_LEN(rreq_opt) / sizeof(struct in_addr);
 	
-	if (dp->srt->src.s_addr == myaddr.s_addr)
-		return DSR_PKT_DROP;
+	if (dp->srt->src.s_addr == myaddr.s_addr) {
+		action = DSR_PKT_DROP;
+		goto out;
+	}
 	
 	for (i = 0; i < n; i++)
 		if (dp->srt->addrs[i].s_addr == myaddr.s_addr) {
@@ -595,54 +1519,70 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 			goto out;
 		}
 
-	/* TODO: Check Blacklist */
-	srt_rc = lc_srt_find(myaddr, trg);
-	
-	if (srt_rc) {
-		struct dsr_srt *srt_cat;
-		/* Send cached route reply */
-		
-		LOG_DBG("Send cached RREP\n");
-
-		srt_cat = dsr_srt_concatenate(dp->srt, srt_rc);
-		
-		kfree(srt_rc);
-
-		if (!srt_cat) {
-			LOG_DBG("Could not concatenate\n");
-			goto rreq_forward;
-		}
+	/* Data on the request only reaches the target if the flood goes on,
+	 * so do not answer from the cache in that case */
+	if (!payload) {
+		if (!(answered & 1) &&
+		    dsr_rreq_cached_reply(dp, srt_rev, trg))
+			answered |= 1;
+
+		for (i = 0; i < ntrgs; i++) {
+			struct in_addr t;
+
+			if (answered & (1 << (i + 1)))
+				continue;
+
+			t.s_addr = trgs_opt->targets[i];
 
-		LOG_DBG("srt_cat: %s\n", print_srt(srt_cat));
-		
-		if (dsr_srt_check_duplicate(srt_cat) > 0) {
-			LOG_DBG("Duplicate address in source route!!!\n");
-			kfree(srt_cat);
-			goto rreq_forward;				
+			if (dsr_rreq_cached_reply(dp, srt_rev, t))
+				answered |= (1 << (i + 1));
 		}
+	}
+
+	if ((answered & all) == all) {
+		action = DSR_PKT_NONE;
+	} else {
+		/* Let nodes further out know which targets are taken care
+		 * of */
+		if (trgs_opt)
+			trgs_opt->answered = htons(answered);
+
+		/* The IP TTL bounds how far the request propagates */
 #ifdef NS2
-		dp->nh.iph->daddr() = (nsaddr_t) rreq_opt->target;
+		ttl = dp->nh.iph->ttl();
 #else
-		dp->nh.iph->daddr = rreq_opt->target;
+		ttl = dp->nh.iph->ttl;
 #endif
-		LOG_DBG("Sending cached RREP to %s\n", print_ip(dp->src));
-		dsr_rrep_send(srt_rev, srt_cat);
-		
-		action = DSR_PKT_NONE;	
-		
-		kfree(srt_cat);
-	} else {
+		if (probe) {
+			LOG_DBG("Starting local discovery for %s\n",
+				print_ip(trg));
+			rreq_opt = dsr_rreq_probe_flood(dp, rreq_opt);
+			ttl = ConfVal(LocalDiscoveryTTL) + 1;
+		}
+		if (ttl <= 1) {
+			LOG_DBG("RREQ TTL expired, not forwarding\n");
+			action = DSR_PKT_NONE;
+			goto out;
+		}
 
-	rreq_forward:	
-		dsr_pkt_alloc_opts_expand(dp, sizeof(struct in_addr));
+		rreq_off = (char *)rreq_opt - dp->dh.raw;
+		opts_end = ntohs(dp->dh.opth->p_len) + 4;
+
+		if (!dsr_pkt_alloc_opts_expand(dp, sizeof(struct in_addr))) {
+			LOG_DBG("Could not expand options\n");
+			action = DSR_PKT_ERROR;
+			goto out;
+		}
+		/* The options may have been moved to a larger buffer */
+		rreq_opt = (struct dsr_rreq_opt *)(dp->dh.raw + rreq_off);
+		dp->rreq_opt = rreq_opt;
 
 		if (!DSR_LAST_OPT(dp, rreq_opt)) {
 			char *to, *from;
-			to = (char *)rreq_opt + rreq_opt->length + 2 +
-			    sizeof(struct in_addr);
 			from = (char *)rreq_opt + rreq_opt->length + 2;
+			to = from + sizeof(struct in_addr);
 
-			memmove(to, from, sizeof(struct in_addr));
+			memmove(to, from, dp->dh.raw + opts_end - from);
 		}
 		rreq_opt->addrs[n] = myaddr.s_addr;
 		rreq_opt->length += sizeof(struct in_addr);
@@ -652,14 +1592,16 @@ int NSCLASS dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt)
 #ifdef __KERNEL__
 		dsr_build_ip(dp, dp->src, dp->dst, IP_HDR_LEN,
 			     ntohs(dp->nh.iph->tot_len) +
-			     sizeof(struct in_addr), IPPROTO_DSR,
-			     dp->nh.iph->ttl);
+			     sizeof(struct in_addr), IPPROTO_DSR, ttl - 1);
+#else
+		dp->nh.iph->ttl() = ttl - 1;
 #endif
 		/* Forward RREQ */
+		rreq_stats.forwarded++;
 		action = DSR_PKT_FORWARD_RREQ;
 	}
       out:
-	kfree(srt_rev);
+	dsr_srt_put(srt_rev);
 	return action;
 }
 
@@ -684,9 +1626,8 @@ rreq_tbl_proc_info(char *buffer, char **start, off_t offset, int length, int *eo
 /* Similar to above function, for using with proc_create() */
 static int rreq_tbl_proc_show(struct seq_file *m, void *v)
 {
-	list_t *pos1, *pos2;
-	int len = 0;
-	int first = 1;
+	list_t *pos1;
+	unsigned int i;
 	struct timeval now;
 	struct tbl *t = &rreq_tbl;
 
@@ -701,27 +1642,39 @@ static int rreq_tbl_proc_show(struct seq_file *m, void *v)
 		struct rreq_tbl_entry *e = (struct rreq_tbl_entry *)pos1;
 		struct id_entry *id_e;
 
-		if (TBL_EMPTY(&e->rreq_id_tbl))
+		if (e->ids_len == 0)
 			seq_printf(m, "  %-15s %-6u %-8lu %15s:%s\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
 				    "-", "-");
 		else {
-			id_e = (struct id_entry *)TBL_FIRST(&e->rreq_id_tbl);
+			id_e = rreq_tbl_entry_id(e, 0);
 			seq_printf(m, "  %-15s %-6u %-8lu %15s:%u\n",
 				    print_ip(e->node_addr), e->ttl,
 				    timeval_diff(&now, &e->last_used) / 1000000,
 				    print_ip(id_e->trg_addr), id_e->id);
 		}
-		list_for_each(pos2, &e->rreq_id_tbl.head) {
-			id_e = (struct id_entry *)pos2;
-			if (!first)
-				seq_printf(m, "%49s:%u\n",
-					    print_ip(id_e->trg_addr), id_e->id);
-			first = 0;
+		for (i = 1; i < e->ids_len; i++) {
+			id_e = rreq_tbl_entry_id(e, i);
+			seq_printf(m, "%49s:%u\n",
+				    print_ip(id_e->trg_addr), id_e->id);
 		}
 	}
 
+	seq_printf(m, "\n# Discoveries Sent Rexmts Throttled Throttled(target) Piggybacked Probes\n"
+		   "  %lu %lu %lu %lu %lu %lu %lu\n"
+		   "# Recv Duplicates Forwarded Suppressed\n"
+		   "  %lu %lu %lu %lu\n"
+		   "# WindowReplies Switches HopsSaved\n"
+		   "  %lu %lu %lu\n",
+		   rreq_stats.discoveries, rreq_stats.sent,
+		   rreq_stats.rexmts, rreq_stats.throttled,
+		   rreq_stats.throttled_target, rreq_stats.piggybacked,
+		   rreq_stats.probes, rreq_stats.recv,
+		   rreq_stats.duplicates, rreq_stats.forwarded,
+		   rreq_stats.suppressed, rreq_stats.window_replies,
+		   rreq_stats.route_switches, rreq_stats.hops_saved);
+
 	read_unlock_bh(&t->lock);
 	return 0;
 }
@@ -743,6 +1696,7 @@ static const struct file_operations rreq_tbl_proc_fops = {
 
 int __init NSCLASS rreq_tbl_init(void)
 {
+	int i;
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
@@ -768,12 +1722,39 @@ int __init NSCLASS rreq_tbl_init(void)
 
 	INIT_TBL(&rreq_tbl, RREQ_TBL_MAX_LEN);
 
+	rreq_diameter = 0;
+
+	rreq_coalesce.n = 0;
+	rreq_coalesce.ttl = 0;
+	init_timer(&rreq_coalesce_timer);
+
+	for (i = 0; i < RREQ_ID_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&rreq_id_hash[i]);
+
+	INIT_TBL(&rreq_fwd_tbl, RREQ_FWD_TBL_MAX_LEN);
+	init_timer(&rreq_fwd_timer);
+
+	rreq_bucket_init(&rreq_bucket, ConfVal(RREQBurst));
+	memset(&rreq_stats, 0, sizeof(rreq_stats));
+
 	return 0;
 }
 
 void __exit NSCLASS rreq_tbl_cleanup(void)
 {
 	struct rreq_tbl_entry *e;
+	struct rreq_fwd_entry *f;
+
+	if (timer_pending(&rreq_fwd_timer))
+		del_timer_sync(&rreq_fwd_timer);
+
+	if (timer_pending(&rreq_coalesce_timer))
+		del_timer_sync(&rreq_coalesce_timer);
+
+	while ((f = (struct rreq_fwd_entry *)tbl_detach_first(&rreq_fwd_tbl))) {
+		dsr_pkt_free(f->dp);
+		kfree(f);
+	}
 
 	while ((e = (struct rreq_tbl_entry *)tbl_detach_first(&rreq_tbl))) {
 		del_timer_sync(e->timer);
@@ -782,7 +1763,8 @@ void __exit NSCLASS rreq_tbl_cleanup(void)
 #else
 		kfree(e->timer);
 #endif
-		tbl_flush(&e->rreq_id_tbl, crit_none);
+		rreq_tbl_entry_ids_unhash(e);
+		kfree(e);
 	}
 #ifdef __KERNEL__
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
@@ -30,14 +30,80 @@ struct dsr_rreq_opt {
 #define DSR_RREQ_TOT_LEN IP_HDR_LEN + sizeof(struct dsr_opt_hdr) + sizeof(struct dsr_rreq_opt)
 #define DSR_RREQ_ADDRS_LEN(rreq_opt) (rreq_opt->length - 6)
 
+/* Extra targets of a coalesced RREQ. Follows the RREQ option. Bit 0 of the
+ * answered mask is the target in the RREQ option, bit i + 1 is targets[i].
+ * Nodes set the bits of the targets they replied for, so that nodes further
+ * out do not reply again. */
+struct dsr_rreq_trgs_opt {
+	u_int8_t type;
+	u_int8_t length;
+	u_int16_t answered;
+	u_int32_t targets[0];
+};
+
+#define DSR_RREQ_TRGS_HDR_LEN sizeof(struct dsr_rreq_trgs_opt)
+#define DSR_RREQ_TRGS_NUM(trgs_opt) (((trgs_opt)->length - 2) / sizeof(u_int32_t))
+
+/* Max targets per RREQ, one bit each in the answered mask */
+#define RREQ_MAX_TARGETS 16
+
+/* Targets waiting for the coalescing window to close */
+struct rreq_coalesce {
+	int n;
+	int ttl;
+	struct in_addr targets[RREQ_MAX_TARGETS];
+};
+
+/* Buckets in the (initiator, target, id) hash used for duplicate detection */
+#define RREQ_ID_HASH_SIZE 256
+
+/* Max number of RREQs held back for rebroadcast suppression */
+#define RREQ_FWD_TBL_MAX_LEN 64
+
+struct id_entry;
+struct rreq_tbl_entry;
+
+/* Token bucket limiting the rate of originated RREQs. Tokens are kept in
+ * thousandths to allow rates below one per second to accumulate. */
+struct rreq_bucket {
+	unsigned long mtokens;
+	struct timeval last;
+};
+
+struct rreq_stats {
+	unsigned long discoveries;	/* Route discoveries started */
+	unsigned long sent;		/* Originated RREQs, incl. rexmts */
+	unsigned long rexmts;
+	unsigned long throttled;	/* Held back by the global bucket */
+	unsigned long throttled_target;	/* Held back by a target bucket */
+	unsigned long piggybacked;	/* RREQs that carried data */
+	unsigned long probes;		/* Source routed local discoveries */
+	unsigned long recv;
+	unsigned long duplicates;
+	unsigned long forwarded;
+	unsigned long suppressed;
+	unsigned long window_replies;	/* Later RREPs within RREPWindow */
+	unsigned long route_switches;	/* ... that gave a shorter route */
+	unsigned long hops_saved;	/* Total hops saved by switching */
+};
+
 #endif				/* NO_GLOBALS */
 
 #ifndef NO_DECLS
 void rreq_tbl_set_max_len(unsigned int max_len);
 int dsr_rreq_opt_recv(struct dsr_pkt *dp, struct dsr_rreq_opt *rreq_opt);
-int rreq_tbl_route_discovery_cancel(struct in_addr dst);
+int rreq_tbl_route_discovery_cancel(struct in_addr dst, int hops);
+void rreq_diameter_update(int hops);
 int dsr_rreq_route_discovery(struct in_addr target);
 int dsr_rreq_send(struct in_addr target, int ttl);
+int dsr_rreq_send_multi(struct in_addr *targets, int n, int ttl);
+int dsr_rreq_send_piggyback(struct in_addr target, int ttl);
+int dsr_rreq_send_probe(struct in_addr target, struct dsr_srt *srt);
+int __rreq_coalesce_add(struct in_addr target, int ttl);
+void __rreq_coalesce_del(struct in_addr target);
+void rreq_coalesce_timeout(unsigned long data);
+int dsr_rreq_cached_reply(struct dsr_pkt *dp, struct dsr_srt *srt_rev,
+			  struct in_addr target);
 void rreq_tbl_timeout(unsigned long data);
 struct rreq_tbl_entry *__rreq_tbl_entry_create(struct in_addr node_addr);
 struct rreq_tbl_entry *__rreq_tbl_add(struct in_addr node_addr);
@@ -45,6 +111,14 @@ int rreq_tbl_add_id(struct in_addr initiator, struct in_addr target,
 		    unsigned short id);
 int dsr_rreq_duplicate(struct in_addr initiator, struct in_addr target,
 		       unsigned int id);
+struct id_entry *__rreq_id_find(struct in_addr initiator,
+				struct in_addr target, unsigned short id);
+int __rreq_rate_allow(struct rreq_tbl_entry *e);
+unsigned int rreq_fwd_threshold(void);
+void rreq_fwd_tbl_timeout(unsigned long data);
+int rreq_fwd_tbl_hold(struct dsr_pkt *dp);
+void rreq_fwd_tbl_dup(struct in_addr initiator, struct in_addr target,
+		      unsigned short id);
 
 int rreq_tbl_init(void);
 void rreq_tbl_cleanup(void);
@@ -208,6 +208,8 @@ struct dsr_srt *dsr_rtc_find(struct in_addr src, struct in_addr dst)
 		srt =
 		    MALLOC(e->srt.laddrs + sizeof(struct dsr_srt), GFP_ATOMIC);
 		memcpy(srt, &e->srt, e->srt.laddrs + sizeof(struct dsr_srt));
+		atomic_set(&srt->refcnt, 1);
+		srt->opts = NULL;
 		DSR_READ_UNLOCK(&rtc_lock);
 		return srt;
 	}
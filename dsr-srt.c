@@ -10,6 +10,7 @@
 #ifdef __KERNEL__
 #include <linux/slab.h>
 #include <net/ip.h>
+#include "dsr-dev.h"
 #endif
 
 #ifdef NS2
@@ -24,6 +25,7 @@
 #include "neigh.h"
 #include "dsr-rrep.h"
 #include "debug.h"
+#include "dsr-flow.h"
 
 struct in_addr dsr_srt_next_hop(struct dsr_srt *srt, int sleft)
 {
@@ -74,8 +76,7 @@ struct dsr_srt *dsr_srt_new(struct in_addr src, struct in_addr dst,
 {
 	struct dsr_srt *sr;
 
-	sr = (struct dsr_srt *)kmalloc(sizeof(struct dsr_srt) + length,
-				       GFP_ATOMIC);
+	sr = dsr_srt_alloc(length);
 
 	if (!sr)
 		return NULL;
@@ -99,8 +100,7 @@ struct dsr_srt *dsr_srt_new_rev(struct dsr_srt *srt)
 	if (!srt)
 		return NULL;
 
-	srt_rev = (struct dsr_srt *)kmalloc(sizeof(struct dsr_srt) +
-					    srt->laddrs, GFP_ATOMIC);
+	srt_rev = dsr_srt_alloc(srt->laddrs);
 
 	if (!srt_rev)
 		return NULL;
@@ -139,9 +139,7 @@ struct dsr_srt *dsr_srt_new_split(struct dsr_srt *srt, struct in_addr addr)
 	return NULL;
 
       split:
-	srt_split = (struct dsr_srt *)kmalloc(sizeof(struct dsr_srt) +
-					      (i * sizeof(struct in_addr)),
-					      GFP_ATOMIC);
+	srt_split = dsr_srt_alloc(i * sizeof(struct in_addr));
 	
 	if (!srt_split)
 		return NULL;
@@ -166,7 +164,7 @@ struct dsr_srt *dsr_srt_new_split_rev(struct dsr_srt *srt, struct in_addr addr)
 
 	srt_split_rev = dsr_srt_new_rev(srt_split);
 
-	kfree(srt_split);
+	dsr_srt_put(srt_split);
 
 	return srt_split_rev;
 }
@@ -200,9 +198,7 @@ struct dsr_srt *dsr_srt_shortcut(struct dsr_srt *srt, struct in_addr a1,
 
 	n_cut = n - (a2_num - a1_num - 1);
 
-	srt_cut = (struct dsr_srt *)kmalloc(sizeof(struct dsr_srt) +
-					    (n_cut*sizeof(struct in_addr)),
-					    GFP_ATOMIC);
+	srt_cut = dsr_srt_alloc(n_cut*sizeof(struct in_addr));
 	
 	if (!srt_cut)
 		return NULL;
@@ -240,9 +236,7 @@ struct dsr_srt *dsr_srt_concatenate(struct dsr_srt *srt1, struct dsr_srt *srt2)
 	 * of the second. We therefore only count that node once. */
 	n = n1 + n2 + 1;
 	
-	srt_cat = (struct dsr_srt *)kmalloc(sizeof(struct dsr_srt) +
-					    (n * sizeof(struct in_addr)),
-					    GFP_ATOMIC);
+	srt_cat = dsr_srt_alloc(n * sizeof(struct in_addr));
 	
 	if (!srt_cat)
 		return NULL;
@@ -318,11 +312,52 @@ struct dsr_srt_opt *dsr_srt_opt_add(char *buf, int len, int flags,
 	return srt_opt;
 }
 
+/* Return the DSR options that packets originated on srt start with, building
+ * them the first time. The route may be shared with other CPUs, so the
+ * first builder to attach its copy wins. */
+static char *dsr_srt_opts_get(struct dsr_srt *srt)
+{
+	char *opts;
+	int len = DSR_OPT_HDR_LEN + DSR_SRT_OPT_LEN(srt);
+
+	if (srt->opts)
+		return srt->opts;
+
+	opts = (char *)kmalloc(len, GFP_ATOMIC);
+
+	if (!opts)
+		return NULL;
+
+	dsr_opt_hdr_add(opts, len, 0);
+	dsr_srt_opt_add(opts + DSR_OPT_HDR_LEN, len - DSR_OPT_HDR_LEN, 0, 0,
+			srt);
+#ifdef __KERNEL__
+	if (cmpxchg(&srt->opts, NULL, opts) != NULL)
+		kfree(opts);
+#else
+	srt->opts = opts;
+#endif
+	return srt->opts;
+}
+
+/* The largest IP packet that still fits in link_mtu when sent over srt,
+ * with room for an ACK Request */
+int NSCLASS dsr_srt_mtu(struct dsr_srt *srt, int link_mtu)
+{
+	return link_mtu - (DSR_OPT_HDR_LEN + DSR_SRT_OPT_LEN(srt) +
+			   DSR_ACK_REQ_HDR_LEN);
+}
+
 int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 {
+	char *opts = NULL;
 	char *buf;
 	int n, len, ttl, tot_len, ip_len;
-	int prot = 0;
+	int prot = 0, flow = FLOW_NONE;
+	unsigned short flow_id = 0;
+#ifdef __KERNEL__
+	int mtu;
+#endif
 
 	if (!dp || !dp->srt)
 		return -1;
@@ -331,10 +366,39 @@ int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 
 	dp->nxt_hop = dsr_srt_next_hop(dp->srt, n);
 
+#ifdef __KERNEL__
+	/* Bounce packets that would not fit the route after adding the
+	 * options, the sender learns the path MTU */
+	mtu = dsr_dev_link_mtu();
+
+	if (!dp->salvage && mtu) {
+		mtu = dsr_srt_mtu(dp->srt, mtu);
+
+		if (ntohs(dp->nh.iph->tot_len) > mtu) {
+			dsr_dev_frag_needed(dp, mtu);
+			return -1;
+		}
+	}
+#endif
+	/* Once a flow is established along the route, packets only carry
+	 * the Flow State header. That header has no room for an ACK
+	 * Request, so flows are only set up where link layer feedback
+	 * detects broken links, i.e., in ns-2. */
+#ifdef NS2
+	if (!dp->salvage && ConfVal(FlowStateTimeout))
+		flow = dsr_flow_get(dp, &flow_id);
+#endif
+
+	if (flow == FLOW_ESTABLISHED)
+		return dsr_flow_hdr_add(dp, flow_id);
+
 	/* Calculate extra space needed */
 
 	len = DSR_OPT_HDR_LEN + DSR_SRT_OPT_LEN(dp->srt);
 
+	if (flow == FLOW_NEW)
+		len += DSR_FLOW_OPTS_LEN;
+
 	LOG_DBG("SR: %s\n", print_srt(dp->srt));
 
 	buf = dsr_pkt_alloc_opts(dp, len);
@@ -365,6 +429,21 @@ int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 	if (!dp->nh.iph)
 		return -1;
 
+	/* Salvaged packets need their own salvage count */
+	if (!dp->salvage && flow == FLOW_NONE)
+		opts = dsr_srt_opts_get(dp->srt);
+
+	if (opts) {
+		/* Copy the prebuilt options, only the next header differs */
+		memcpy(buf, opts, len);
+
+		dp->dh.opth = (struct dsr_opt_hdr *)buf;
+		dp->dh.opth->nh = prot;
+		dp->srt_opt = (struct dsr_srt_opt *)(buf + DSR_OPT_HDR_LEN);
+
+		return 0;
+	}
+
 	dp->dh.opth = dsr_opt_hdr_add(buf, len, prot);
 
 	if (!dp->dh.opth) {
@@ -385,6 +464,10 @@ int NSCLASS dsr_srt_add(struct dsr_pkt *dp)
 	buf += DSR_SRT_OPT_LEN(dp->srt);
 	len -= DSR_SRT_OPT_LEN(dp->srt);
 
+	if (flow == FLOW_NEW && dsr_flow_opts_add(buf, len, flow_id,
+						  dp->dst) < 0)
+		return -1;
+
 	return 0;
 }
 
@@ -452,7 +535,7 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 		if (srt_split) {
 			LOG_DBG("Adding split SRT to cache: %s\n", print_srt(srt_split));
 			dsr_rtc_add(srt_split, ConfValToUsecs(RouteCacheTimeout), 0);
-			kfree(srt_split);
+			dsr_srt_put(srt_split);
 		}
 	}
 	/* Automatic route shortening - Check if this node is the
@@ -482,7 +565,7 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 
 		if (!srt) {
 			LOG_DBG("No route to %s\n", print_ip(dp->src));
-			kfree(srt_cut);
+			dsr_srt_put(srt_cut);
 			return DSR_PKT_DROP;
 		}
 		LOG_DBG("my srt: %s\n", print_srt(srt));
@@ -491,8 +574,8 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 
 		dsr_rrep_send(srt, srt_cut);
 
-		kfree(srt_cut);
-		kfree(srt);
+		dsr_srt_put(srt_cut);
+		dsr_srt_put(srt);
 	}
 
 	if (dp->flags & PKT_PROMISC_RECV)
@@ -509,7 +592,17 @@ int NSCLASS dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt)
 	srt_opt->sleft--;
 
 	/* TODO: check for multicast address in next hop or dst */
-	/* TODO: check MTU and compare to pkt size */
+#ifdef __KERNEL__
+	/* The source sized the packet for the route, but leave room for
+	 * the ACK Request we may add */
+	if (dsr_dev_link_mtu() &&
+	    ntohs(dp->nh.iph->tot_len) +
+	    (dp->ack_req_opt ? 0 : DSR_ACK_REQ_HDR_LEN) > dsr_dev_link_mtu()) {
+		LOG_DBG("Packet too big for next hop %s\n",
+			print_ip(dp->nxt_hop));
+		return DSR_PKT_DROP;
+	}
+#endif
 
 	return DSR_PKT_FORWARD;
 }
@@ -13,6 +13,7 @@
 
 #ifdef NS2
 #include "endian.h"
+#include "atomic.h"
 #endif
 
 #ifndef NO_GLOBALS
@@ -49,6 +50,8 @@ struct dsr_srt_opt {
 
 #define DSR_SRT_HDR_LEN sizeof(struct dsr_srt_opt)
 #define DSR_SRT_OPT_LEN(srt) (DSR_SRT_HDR_LEN + srt->laddrs)
+#define DSR_SRT_HOPS(srt) ((srt)->laddrs / sizeof(struct in_addr) + 1)
+#define DSR_SRT_OPT_HOPS(srt_opt) (((srt_opt)->length - 2) / sizeof(struct in_addr) + 1)
 
 /* Flags */
 #define SRT_BIDIR 0x1
@@ -60,9 +63,46 @@ struct dsr_srt {
 	unsigned short flags;
 	unsigned short index;
 	unsigned int laddrs;	/* length in bytes if addrs */
+	atomic_t refcnt;
+	char *opts;		/* Option header and source route option for
+				 * packets we originate, built on first use */
 	struct in_addr addrs[0];	/* Intermediate nodes */
 };
 
+/* Source routes are shared, e.g., between the route cache and all packets
+ * sent on a route, and must not be modified once handed out. Use
+ * dsr_srt_get() to take a reference and dsr_srt_put() to release it. */
+static inline struct dsr_srt *dsr_srt_alloc(unsigned int laddrs)
+{
+	struct dsr_srt *srt;
+
+	srt = (struct dsr_srt *)kmalloc(sizeof(struct dsr_srt) + laddrs,
+					GFP_ATOMIC);
+	if (!srt)
+		return NULL;
+
+	memset(srt, 0, sizeof(struct dsr_srt));
+	atomic_set(&srt->refcnt, 1);
+
+	return srt;
+}
+
+static inline struct dsr_srt *dsr_srt_get(struct dsr_srt *srt)
+{
+	if (srt)
+		atomic_inc(&srt->refcnt);
+	return srt;
+}
+
+static inline void dsr_srt_put(struct dsr_srt *srt)
+{
+	if (srt && atomic_dec_and_test(&srt->refcnt)) {
+		if (srt->opts)
+			kfree(srt->opts);
+		kfree(srt);
+	}
+}
+
 static inline char *print_srt(struct dsr_srt *srt)
 {
 #define BUFLEN 256
@@ -88,7 +128,6 @@ struct dsr_srt_opt *dsr_srt_opt_add(char *buf, int len, int flags, int salvage,
 struct dsr_srt *dsr_srt_new(struct in_addr src, struct in_addr dst,
 			    unsigned int length, char *addrs);
 struct dsr_srt *dsr_srt_new_rev(struct dsr_srt *srt);
-void dsr_srt_del(struct dsr_srt *srt);
 struct dsr_srt *dsr_srt_concatenate(struct dsr_srt *srt1, struct dsr_srt *srt2);int dsr_srt_check_duplicate(struct dsr_srt *srt);
 struct dsr_srt *dsr_srt_new_split(struct dsr_srt *srt, struct in_addr addr);
 
@@ -97,6 +136,7 @@ struct dsr_srt *dsr_srt_new_split(struct dsr_srt *srt, struct in_addr addr);
 #ifndef NO_DECLS
 
 int dsr_srt_add(struct dsr_pkt *dp);
+int dsr_srt_mtu(struct dsr_srt *srt, int link_mtu);
 int dsr_srt_opt_recv(struct dsr_pkt *dp, struct dsr_srt_opt *srt_opt);
 
 #endif				/* NO_DECLS */
@@ -45,10 +45,12 @@
 #define IPPROTO_DSR 168		/* Is this correct? */
 #endif
 #define IP_HDR_LEN 20
-#define DSR_OPTS_MAX_SIZE 50	/* This is used to reduce the MTU of the DSR *
-				 * device so that packets are not too big after
-				 * adding the DSR header. A better solution
-				 * should probably be found... */
+#define DSR_OPTS_MAX_SIZE 50	/* Size of the DSR packet header in ns-2 */
+#define DSR_OPTS_MIN_SIZE 12	/* Options header, a Source Route option
+				 * without intermediate hops and an ACK
+				 * Request. The DSR device MTU only leaves
+				 * room for these, longer routes have a
+				 * smaller path MTU, see dsr_srt_mtu() */
 
 enum confval {
 #ifdef ENABLE_DEBUG
@@ -78,6 +80,35 @@ enum confval {
 	PassiveAckTimeout,
 	GratReplyHoldOff,
 	MAX_SALVAGE_COUNT,
+	RREQSuppressThreshold, /* Cancel a jittered RREQ rebroadcast once
+				* this many copies have been overheard. 0
+				* disables suppression. */
+	RREQRateLimit,		/* Originated RREQs per second, 0 = no limit */
+	RREQBurst,
+	RREQTargetRateLimit,	/* Per target RREQs per second, 0 = no limit */
+	RREQTargetBurst,
+	RREQCoalesceWindow,	/* Discoveries started within this window
+				 * share one RREQ, 0 = off */
+	RREQPiggybackMaxLen,	/* Max payload bytes to carry on a RREQ,
+				 * 0 = off */
+	LocalDiscoveryTTL,	/* TTL of a discovery started at the end of a
+				 * partial cached route, 0 = off */
+	LocalRepairTTL,		/* TTL of a RREQ sent to repair a broken
+				 * route locally, 0 = off */
+	LocalRepairTimeout,	/* How long to hold packets during a local
+				 * repair */
+	RREPWindow,		/* Time after the first RREP during which
+				 * shorter routes are tracked, 0 = off */
+	CachedReplyDelay,	/* Per hop delay of cached RREPs, 0 = send
+				 * immediately */
+	RERRCoalesceWindow,	/* Link breaks reported to the same node
+				 * within this window share one RERR,
+				 * 0 = off */
+	RREQErrorHoldTime,	/* How long a received RERR is carried on
+				 * our RREQs, 0 = off */
+	FlowStateTimeout,	/* Lifetime of flows that let packets skip
+				 * the source route, 0 = off. Only used in
+				 * ns-2, see dsr_srt_add() */
 	CONFVAL_MAX,
 };
 
@@ -95,6 +126,7 @@ enum confval_type {
 #define MAINT_BUF_MAX_LEN 100
 #define RREQ_TBL_MAX_LEN 64	/* Should be enough */
 #define SEND_BUF_MAX_LEN 100
+#define REPAIR_BUF_MAX_LEN 32
 #define RREQ_TLB_MAX_ID 16
 
 static struct {
@@ -128,7 +160,22 @@ static struct {
 		"TryPassiveAcks", 1, QUANTA}, {
 		"PassiveAckTimeout", 100, MILLISECONDS}, {
 		"GratReplyHoldOff", 1, SECONDS}, {
-		"MAX_SALVAGE_COUNT", 15, QUANTA}
+		"MAX_SALVAGE_COUNT", 15, QUANTA}, {
+		"RREQSuppressThreshold", 0, QUANTA}, {
+		"RREQRateLimit", 0, QUANTA}, {
+		"RREQBurst", 10, QUANTA}, {
+		"RREQTargetRateLimit", 0, QUANTA}, {
+		"RREQTargetBurst", 3, QUANTA}, {
+		"RREQCoalesceWindow", 0, MILLISECONDS}, {
+		"RREQPiggybackMaxLen", 0, QUANTA}, {
+		"LocalDiscoveryTTL", 0, QUANTA}, {
+		"LocalRepairTTL", 0, QUANTA}, {
+		"LocalRepairTimeout", 250, MILLISECONDS}, {
+		"RREPWindow", 0, MILLISECONDS}, {
+		"CachedReplyDelay", 0, MICROSECONDS}, {
+		"RERRCoalesceWindow", 0, MILLISECONDS}, {
+		"RREQErrorHoldTime", 0, MILLISECONDS}, {
+		"FlowStateTimeout", 0, SECONDS}
 };
 
 struct dsr_node {
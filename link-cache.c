@@ -38,6 +38,9 @@ static struct lc_graph LC;
 #define LC_NODES_MAX 500
 #define LC_LINKS_MAX 100	/* TODO: Max links should be calculated from Max
 				 * nodes */
+#define LC_ROUTES_MAX 32	/* Destinations with a precomputed route pair */
+#define LC_BROKEN_MAX 32	/* Recently broken links remembered */
+#define LC_BROKEN_LIFETIME 10 * 1000000	/* 10 Seconds */
 
 #ifndef UINT_MAX
 #define UINT_MAX 4294967295U   /* Max for 32-bit integer */
@@ -59,16 +62,39 @@ struct lc_node {
 				 * length of the source route to allocate. Same as
 				 * cost if cost is hops. */
 	struct lc_node *pred;	/* predecessor */
+	unsigned int dst_hops;	/* Hops to the destination of a partial route
+				 * search */
 };
 
 struct lc_link {
 	list_t l;
 	struct lc_node *src, *dst;
 	int status;
+	int excluded;		/* Skipped by Dijkstra when computing a backup */
 	unsigned int cost;
 	struct timeval expires;
 };
 
+/* Precomputed routes for an active destination. The backup route is link
+ * disjoint with the primary, so that when a link on the primary breaks, the
+ * backup can take over. It is only computed when the primary first
+ * breaks. */
+struct lc_route {
+	list_t l;
+	struct in_addr src, dst;
+	struct dsr_srt *primary;
+	struct dsr_srt *backup;
+	int backup_stale;	/* Backup must be computed before failing over */
+};
+
+/* A link that broke recently. Its far end may still have a cached route to
+ * a destination, which makes its near end a good place to search from. */
+struct lc_broken {
+	list_t l;
+	struct in_addr src, dst;
+	struct timeval expires;
+};
+
 struct link_query {
 	struct in_addr src, dst;
 };
@@ -113,6 +139,37 @@ static inline int crit_link_query(void *pos, void *query)
 	return 0;
 }
 
+static inline int crit_link_query_broken(void *pos, void *query)
+{
+	struct lc_broken *b = (struct lc_broken *)pos;
+	struct link_query *q = (struct link_query *)query;
+
+	if (b->src.s_addr == q->src.s_addr && b->dst.s_addr == q->dst.s_addr)
+		return 1;
+	return 0;
+}
+
+static inline int crit_route_query(void *pos, void *query)
+{
+	struct lc_route *r = (struct lc_route *)pos;
+	struct link_query *q = (struct link_query *)query;
+
+	if (r->src.s_addr == q->src.s_addr && r->dst.s_addr == q->dst.s_addr)
+		return 1;
+	return 0;
+}
+
+static inline int do_route_free(void *pos, void *data)
+{
+	struct lc_route *r = (struct lc_route *)pos;
+
+	if (r->primary)
+		dsr_srt_put(r->primary);
+	if (r->backup)
+		dsr_srt_put(r->backup);
+	return 0;
+}
+
 static inline int crit_expire(void *pos, void *data)
 {
 	struct lc_link *link = (struct lc_link *)pos;
@@ -149,7 +206,28 @@ static inline int do_relax(void *pos, void *node)
 	struct lc_node *v = link->dst;
 
 	/* If u and v have a link between them, update cost if cheaper */
-	if (link->src == u) {
+	if (link->src == u && !link->excluded) {
+		unsigned int w = link->cost;
+
+		if ((u->cost + w) < v->cost) {
+			v->cost = u->cost + w;
+			v->hops = u->hops + 1;
+			v->pred = u;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Same as do_relax, but follows links backwards to compute distances to
+ * rather than from a node */
+static inline int do_relax_rev(void *pos, void *node)
+{
+	struct lc_link *link = (struct lc_link *)pos;
+	struct lc_node *u = (struct lc_node *)node;
+	struct lc_node *v = link->src;
+
+	if (link->dst == u && !link->excluded) {
 		unsigned int w = link->cost;
 
 		if ((u->cost + w) < v->cost) {
@@ -182,6 +260,13 @@ static inline int do_init(void *pos, void *addr)
 	return 0;
 }
 
+/* Drop all precomputed routes, e.g., when the topology grows so that the
+ * shortest paths may have changed */
+void NSCLASS __lc_routes_flush(void)
+{
+	__tbl_flush(&LC.routes, do_route_free);
+}
+
 #ifdef LC_TIMER
 
 void NSCLASS lc_garbage_collect(unsigned long data)
@@ -197,7 +282,8 @@ void NSCLASS lc_garbage_collect(unsigned long data)
 
 	write_lock_bh(&LC.lock);
 
-	__tbl_do_for_each(&LC.links, &LC, crit_expire);
+	if (__tbl_do_for_each(&LC.links, &LC, crit_expire))
+		__lc_routes_flush();
 
 	if (!__tbl_empty(&LC.links))
 		lc_garbage_collect_set();
@@ -252,6 +338,88 @@ static inline struct lc_link *__lc_link_find(struct tbl *t, struct in_addr src,
 	return (struct lc_link *)__tbl_find(t, &q, crit_link_query);
 }
 
+/* Returns 1 if the source route traverses the link a<->b in either
+ * direction */
+static int lc_srt_uses_link(struct dsr_srt *srt, struct in_addr a,
+			    struct in_addr b)
+{
+	struct in_addr prev = srt->src, next;
+	int i, n = srt->laddrs / sizeof(struct in_addr);
+
+	for (i = 0; i <= n; i++) {
+		next = (i == n) ? srt->dst : srt->addrs[i];
+
+		if ((prev.s_addr == a.s_addr && next.s_addr == b.s_addr) ||
+		    (prev.s_addr == b.s_addr && next.s_addr == a.s_addr))
+			return 1;
+		prev = next;
+	}
+	return 0;
+}
+
+static int lc_srt_uses_node(struct dsr_srt *srt, struct in_addr a)
+{
+	int i, n = srt->laddrs / sizeof(struct in_addr);
+
+	if (srt->src.s_addr == a.s_addr || srt->dst.s_addr == a.s_addr)
+		return 1;
+
+	for (i = 0; i < n; i++)
+		if (srt->addrs[i].s_addr == a.s_addr)
+			return 1;
+
+	return 0;
+}
+
+/* Mark (or unmark) all links of a source route, in both directions, so that
+ * Dijkstra does not use them */
+void NSCLASS __lc_srt_exclude(struct dsr_srt *srt, int exclude)
+{
+	struct in_addr prev = srt->src, next;
+	struct lc_link *link;
+	int i, n = srt->laddrs / sizeof(struct in_addr);
+
+	for (i = 0; i <= n; i++) {
+		next = (i == n) ? srt->dst : srt->addrs[i];
+
+		link = __lc_link_find(&LC.links, prev, next);
+		if (link)
+			link->excluded = exclude;
+
+		link = __lc_link_find(&LC.links, next, prev);
+		if (link)
+			link->excluded = exclude;
+
+		prev = next;
+	}
+}
+
+static void __lc_broken_add(struct tbl *t, struct in_addr src,
+			    struct in_addr dst)
+{
+	struct link_query q = { src, dst };
+	struct lc_broken *b;
+
+	b = (struct lc_broken *)__tbl_find(t, &q, crit_link_query_broken);
+
+	if (b)
+		__tbl_detach(t, &b->l);
+	else if (TBL_FULL(t))
+		b = (struct lc_broken *)__tbl_detach_first(t);
+	else
+		b = (struct lc_broken *)kmalloc(sizeof(struct lc_broken),
+						GFP_ATOMIC);
+	if (!b)
+		return;
+
+	b->src = src;
+	b->dst = dst;
+	gettime(&b->expires);
+	timeval_add_usecs(&b->expires, LC_BROKEN_LIFETIME);
+
+	__tbl_add_tail(t, &b->l);
+}
+
 static int __lc_link_tbl_add(struct tbl *t, struct lc_node *src,
 			     struct lc_node *dst, usecs_t timeout, 
 			     int status, int cost)
@@ -324,7 +492,9 @@ int NSCLASS __lc_link_add(struct in_addr src, struct in_addr dst,
 
 	res = __lc_link_tbl_add(&LC.links, sn, dn, timeout, status, cost);
 
-	if (res) {
+	if (res > 0) {
+		/* A new link may give shorter routes than those precomputed */
+		__lc_routes_link_add(src, dst);
 #ifdef LC_TIMER
 #ifdef NS2
 		if (!timer_pending(&lc_timer))
@@ -353,6 +523,65 @@ int NSCLASS lc_link_add(struct in_addr src, struct in_addr dst,
 }
 
 
+/* Drop the precomputed routes that the new link src->dst could shorten. A
+ * shorter route has to leave and rejoin the cached one, and the links of a
+ * new route are added together, so only routes through src or dst are
+ * affected. Dropping every route here would make almost every lookup
+ * run Dijkstra, since links are learned from every RREP and overheard
+ * route. */
+void NSCLASS __lc_routes_link_add(struct in_addr src, struct in_addr dst)
+{
+	list_t *pos, *tmp;
+
+	list_for_each_safe(pos, tmp, &LC.routes.head) {
+		struct lc_route *r = (struct lc_route *)pos;
+
+		if (lc_srt_uses_node(r->primary, src) ||
+		    lc_srt_uses_node(r->primary, dst)) {
+			__tbl_detach(&LC.routes, &r->l);
+			do_route_free(r, NULL);
+			kfree(r);
+		}
+	}
+}
+
+/* Fail over precomputed routes that use the broken link src<->dst. A broken
+ * primary is replaced by its backup, which is disjoint and therefore still
+ * valid, so that salvaging and new transmissions can continue immediately.
+ * Must be called while the link is still in the graph. */
+void NSCLASS __lc_routes_link_del(struct in_addr src, struct in_addr dst)
+{
+	list_t *pos, *tmp;
+
+	list_for_each_safe(pos, tmp, &LC.routes.head) {
+		struct lc_route *r = (struct lc_route *)pos;
+
+		if (r->backup && lc_srt_uses_link(r->backup, src, dst)) {
+			dsr_srt_put(r->backup);
+			r->backup = NULL;
+			r->backup_stale = 1;
+		}
+
+		if (!lc_srt_uses_link(r->primary, src, dst))
+			continue;
+
+		/* The broken link is on the primary, which the backup search
+		 * excludes anyway */
+		if (r->backup_stale) {
+			r->backup = __lc_srt_find_backup(r->primary);
+			r->backup_stale = 0;
+		}
+
+		dsr_srt_put(r->primary);
+		r->primary = r->backup;
+		r->backup = NULL;
+		r->backup_stale = 1;
+
+		if (!r->primary)
+			__tbl_del(&LC.routes, &r->l);
+	}
+}
+
 int NSCLASS lc_link_del(struct in_addr src, struct in_addr dst)
 {
 	struct lc_link *link;
@@ -360,6 +589,8 @@ int NSCLASS lc_link_del(struct in_addr src, struct in_addr dst)
 
 	write_lock_bh(&LC.lock);
 
+	__lc_routes_link_del(src, dst);
+
 	link = __lc_link_find(&LC.links, src, dst);
 
 	if (!link) {
@@ -369,6 +600,8 @@ int NSCLASS lc_link_del(struct in_addr src, struct in_addr dst)
 
 	__lc_link_del(&LC, link);
 
+	__lc_broken_add(&LC.broken, src, dst);
+
 	/* Assume bidirectional links for now */
 	link = __lc_link_find(&LC.links, dst, src);
 
@@ -418,7 +651,9 @@ static void __lc_move(struct tbl *to, struct tbl *from)
 	}
 }
 
-void NSCLASS __dijkstra(struct in_addr src)
+/* Run Dijkstra from src, relaxing links with the given function. Returns
+ * the source node, or NULL if it is not in the graph. */
+struct lc_node *NSCLASS __dijkstra_run(struct in_addr src, do_t relax)
 {
 	TBL(S, LC_NODES_MAX);
 	struct lc_node *src_node, *u;
@@ -426,7 +661,7 @@ void NSCLASS __dijkstra(struct in_addr src)
 
 	if (TBL_EMPTY(&LC.nodes)) {
 		LC_DBG("No nodes in Link Cache\n");
-		return;
+		return NULL;
 	}
 
 	__dijkstra_init_single_source(&LC.nodes, src);
@@ -434,7 +669,7 @@ void NSCLASS __dijkstra(struct in_addr src)
 	src_node = (struct lc_node *)__tbl_find(&LC.nodes, &src, crit_addr);
 
 	if (!src_node)
-		return;
+		return NULL;
 
 	while ((u = __dijkstra_find_lowest_cost_node(&LC.nodes))) {
 
@@ -443,7 +678,7 @@ void NSCLASS __dijkstra(struct in_addr src)
 		/* Add to S */
 		__tbl_add_tail(&S, &u->l);
 
-		__tbl_do_for_each(&LC.links, u, do_relax);
+		__tbl_do_for_each(&LC.links, u, relax);
 		i++;
 	}
 
@@ -452,93 +687,228 @@ void NSCLASS __dijkstra(struct in_addr src)
 /* 	LC.nodes = S; */
 	__lc_move(&LC.nodes, &S);
 
+	return src_node;
+}
+
+void NSCLASS __dijkstra(struct in_addr src)
+{
+	struct lc_node *src_node;
+
+	src_node = __dijkstra_run(src, do_relax);
+
 	/* Set currently calculated source */
-	LC.src = src_node;
+	if (src_node)
+		LC.src = src_node;
 }
 
+/* Extract the source route to dst from the result of the last Dijkstra
+ * run */
+struct dsr_srt *NSCLASS __lc_srt_extract(struct in_addr src,
+					 struct in_addr dst)
+{
+	struct dsr_srt *srt;
+	struct lc_node *dst_node, *n;
+	int k, i = 0;
+
+	dst_node = (struct lc_node *)__tbl_find(&LC.nodes, &dst, crit_addr);
+
+	if (!dst_node) {
+		LC_DBG("%s not found\n", print_ip(dst));
+		return NULL;
+	}
+
+	if (dst_node->cost == LC_COST_INF || !dst_node->pred)
+		return NULL;
+
+	k = (dst_node->hops - 1);
+
+	srt = dsr_srt_alloc(k * sizeof(struct in_addr));
+
+	if (!srt) {
+		LC_DBG("Could not allocate source route!!!\n");
+		return NULL;
+	}
+
+	srt->dst = dst;
+	srt->src = src;
+	srt->laddrs = k * sizeof(struct in_addr);
+
+	/* Fill in the source route by traversing the nodes starting
+	 * from the destination predecessor */
+	for (n = dst_node->pred; (n != n->pred); n = n->pred) {
+		srt->addrs[k - i - 1] = n->addr;
+		i++;
+	}
+
+	if ((i + 1) != (int)dst_node->hops) {
+		LC_DBG("hop count ERROR i+1=%d hops=%d!!!\n", i + 1,
+		       dst_node->hops);
+		dsr_srt_put(srt);
+		return NULL;
+	}
+	return srt;
+}
+
+/* Compute the shortest route that shares no link with the primary */
+struct dsr_srt *NSCLASS __lc_srt_find_backup(struct dsr_srt *primary)
+{
+	struct dsr_srt *backup;
+
+	__lc_srt_exclude(primary, 1);
+	__dijkstra(primary->src);
+	backup = __lc_srt_extract(primary->src, primary->dst);
+	__lc_srt_exclude(primary, 0);
+
+	/* The node costs now reflect the restricted graph */
+	LC.src = NULL;
+
+	return backup;
+}
+
+/* Returns a reference to the route shared by all users until the
+ * topology changes. Release it with dsr_srt_put(). */
 struct dsr_srt *NSCLASS lc_srt_find(struct in_addr src, struct in_addr dst)
 {
 	struct dsr_srt *srt = NULL;
-	struct lc_node *dst_node;
+	struct lc_route *r;
+	struct link_query q = { src, dst };
 
 	if (src.s_addr == dst.s_addr)
 		return NULL;
 
+	/* Fast path, the route is already computed */
+	read_lock_bh(&LC.lock);
+
+	r = (struct lc_route *)__tbl_find(&LC.routes, &q, crit_route_query);
+
+	if (r)
+		srt = dsr_srt_get(r->primary);
+
+	read_unlock_bh(&LC.lock);
+
+	if (srt)
+		return srt;
+
 	write_lock_bh(&LC.lock);
 
-/* 	if (!LC.src || LC.src->addr.s_addr != src.s_addr) */
+	r = (struct lc_route *)__tbl_find(&LC.routes, &q, crit_route_query);
+
+	if (r) {
+		srt = dsr_srt_get(r->primary);
+		goto out;
+	}
+
 	__dijkstra(src);
 
-	dst_node = (struct lc_node *)__tbl_find(&LC.nodes, &dst, crit_addr);
+	srt = __lc_srt_extract(src, dst);
 
-	if (!dst_node) {
-		LC_DBG("%s not found\n", print_ip(dst));
+	if (!srt)
 		goto out;
+
+	/* Remember the route. The link disjoint backup is computed when the
+	 * route first breaks. */
+	r = (struct lc_route *)kmalloc(sizeof(struct lc_route), GFP_ATOMIC);
+
+	if (!r)
+		goto out;
+
+	memset(r, 0, sizeof(struct lc_route));
+	r->src = src;
+	r->dst = dst;
+	r->primary = dsr_srt_get(srt);
+	r->backup_stale = 1;
+
+	if (TBL_FULL(&LC.routes)) {
+		struct lc_route *old;
+
+		old = (struct lc_route *)__tbl_detach_first(&LC.routes);
+		do_route_free(old, NULL);
+		kfree(old);
 	}
+	__tbl_add_tail(&LC.routes, &r->l);
+      out:
+	write_unlock_bh(&LC.lock);
+
+	return srt;
+}
+
+/* Find a route to the node from which a local route discovery is most
+ * likely to reach dst, i.e., the near end of a recently broken link whose
+ * far end is closest to dst. Only nodes within max_hops of dst (counting
+ * the broken link) qualify, and src itself never does. */
+struct dsr_srt *NSCLASS lc_srt_find_partial(struct in_addr src,
+					    struct in_addr dst,
+					    unsigned int max_hops)
+{
+	struct dsr_srt *srt = NULL;
+	struct lc_node *best = NULL;
+	unsigned int best_hops = LC_HOPS_INF;
+	list_t *pos, *tmp;
+	struct timeval now;
+
+	if (src.s_addr == dst.s_addr)
+		return NULL;
+
+	gettime(&now);
 
-/* 	lc_print(&LC, lc_print_buf); */
-/* 	LC_DBG("Find SR to node %s\n%s\n", print_ip(dst_node->addr), lc_print_buf); */
+	write_lock_bh(&LC.lock);
 
-/* 	LC_DBG("Hops to %s: %u\n", print_ip(dst), dst_node->hops); */
+	if (TBL_EMPTY(&LC.broken))
+		goto out;
 
-	if (dst_node->cost != LC_COST_INF && dst_node->pred) {
-		struct lc_node *d, *n;
-/* 		struct lc_link *l; */
-		int k = (dst_node->hops - 1);
-		int i = 0;
+	/* Distances towards dst first, then from src */
+	__dijkstra_run(dst, do_relax_rev);
 
-		srt = (struct dsr_srt *)kmalloc(sizeof(struct dsr_srt) +
-					     (k * sizeof(struct in_addr)),
-					     GFP_ATOMIC);
+	list_for_each(pos, &LC.nodes.head) {
+		struct lc_node *n = (struct lc_node *)pos;
+		n->dst_hops = n->hops;
+	}
 
-		if (!srt) {
-			LC_DBG("Could not allocate source route!!!\n");
-			goto out;
+	LC.src = NULL;
+	__dijkstra(src);
+
+	list_for_each_safe(pos, tmp, &LC.broken.head) {
+		struct lc_broken *b = (struct lc_broken *)pos;
+		struct lc_node *near_end, *far_end;
+		unsigned int hops;
+
+		if (timeval_diff(&b->expires, &now) <= 0) {
+			__tbl_del(&LC.broken, &b->l);
+			continue;
 		}
 
-		srt->dst = dst;
-		srt->src = src;
-		srt->laddrs = k * sizeof(struct in_addr);
-
-		/*      l = __lc_link_find(&LC.links, dst_node->pred->addr, dst_node->addr); */
-
-/* 		if (!l) { */
-/* 			LC_DBG("Link not found for timeout update!\n"); */
-/* 		} else { */
-/* 		/\* 	LC_DBG("Updating timeout for link %s->%s\n",  *\/ */
-/* /\* 			      print_ip(l->src->addr),  *\/ */
-/* /\* 			      print_ip(l->dst->addr)); *\/ */
-/* 			gettime(&l->expires); */
-/* 		} */
-
-		d = dst_node;
-
-		/* Fill in the source route by traversing the nodes starting
-		 * from the destination predecessor */
-		for (n = dst_node->pred; (n != n->pred); n = n->pred) {
-
-			/*      l = __lc_link_find(&LC.links, n->addr, d->addr); */
-
-/* 			if (!l) { */
-/* 				LC_DBG("Link not found for timeout update!\n"); */
-/* 			} else { */
-/* 			/\* 	LC_DBG("Updating timeout for link %s->%s\n",  *\/ */
-/* /\* 				      print_ip(l->src->addr),  *\/ */
-/* /\* 				      print_ip(l->dst->addr)); *\/ */
-/* 				gettime(&l->expires); */
-/* 			} */
-			srt->addrs[k - i - 1] = n->addr;
-			i++;
-			d = n;
+		near_end = (struct lc_node *)__tbl_find(&LC.nodes, &b->src,
+							crit_addr);
+
+		if (!near_end || near_end->hops == LC_HOPS_INF ||
+		    near_end->addr.s_addr == src.s_addr)
+			continue;
+
+		if (b->dst.s_addr == dst.s_addr)
+			hops = 1;
+		else {
+			far_end = (struct lc_node *)__tbl_find(&LC.nodes,
+							       &b->dst,
+							       crit_addr);
+
+			if (!far_end || far_end->dst_hops == LC_HOPS_INF)
+				continue;
+
+			hops = far_end->dst_hops + 1;
 		}
 
-		if ((i + 1) != (int)dst_node->hops) {
-			LC_DBG("hop count ERROR i+1=%d hops=%d!!!\n", i + 1,
-			      dst_node->hops);
-			kfree(srt);
-			srt = NULL;
+		if (hops > max_hops)
+			continue;
+
+		if (!best || hops < best_hops ||
+		    (hops == best_hops && near_end->hops < best->hops)) {
+			best = near_end;
+			best_hops = hops;
 		}
 	}
+
+	if (best)
+		srt = __lc_srt_extract(src, best->addr);
       out:
 	write_unlock_bh(&LC.lock);
 
@@ -604,8 +974,10 @@ void NSCLASS lc_flush(void)
 		del_timer(&LC.timer);
 #endif
 #endif
+	__lc_routes_flush();
 	__tbl_flush(&LC.links, NULL);
 	__tbl_flush(&LC.nodes, NULL);
+	__tbl_flush(&LC.broken, NULL);
 
 	LC.src = NULL;
 
@@ -624,6 +996,11 @@ static char *print_hops(unsigned int hops)
 	return c;
 }
 
+static inline unsigned int lc_srt_hops(struct dsr_srt *srt)
+{
+	return srt->laddrs / sizeof(struct in_addr) + 1;
+}
+
 static char *print_cost(unsigned int cost)
 {
 	static char c[18];
@@ -675,6 +1052,19 @@ static int lc_print(struct lc_graph *LC, char *buf)
 			       (unsigned long)n, (unsigned long)n->pred);
 	}
 
+	len += sprintf(buf + len, "\n# %-15s %-7s %-6s\n",
+		       "Dst Addr", "Primary", "Backup");
+
+	list_for_each(pos, &LC->routes.head) {
+		struct lc_route *r = (struct lc_route *)pos;
+
+		len += sprintf(buf + len, "  %-15s %-7u %-6s\n",
+			       print_ip(r->dst),
+			       lc_srt_hops(r->primary),
+			       r->backup ?
+			       print_hops(lc_srt_hops(r->backup)) : "-");
+	}
+
 	read_unlock_bh(&LC->lock);
 	return len;
 
@@ -734,6 +1124,18 @@ static int lc_proc_show(struct seq_file *m, void *v)
 			       (unsigned long)n, (unsigned long)n->pred);
 	}
 
+	seq_printf(m, "\n# %-15s %-7s %-6s\n", "Dst Addr", "Primary", "Backup");
+
+	list_for_each(pos, &LC.routes.head) {
+		struct lc_route *r = (struct lc_route *)pos;
+
+		seq_printf(m, "  %-15s %-7u %-6s\n",
+			   print_ip(r->dst),
+			   lc_srt_hops(r->primary),
+			   r->backup ?
+			   print_hops(lc_srt_hops(r->backup)) : "-");
+	}
+
 	read_unlock_bh(&LC.lock);
 
 	return 0;
@@ -753,6 +1155,7 @@ static const struct file_operations lc_proc_fops = {
 
 EXPORT_SYMBOL(lc_srt_add);
 EXPORT_SYMBOL(lc_srt_find);
+EXPORT_SYMBOL(lc_srt_find_partial);
 EXPORT_SYMBOL(lc_flush);
 EXPORT_SYMBOL(lc_link_del);
 EXPORT_SYMBOL(lc_link_add);
@@ -797,6 +1200,8 @@ int __init NSCLASS lc_init(void)
 	/* Initialize Graph */
 	INIT_TBL(&LC.links, LC_LINKS_MAX);
 	INIT_TBL(&LC.nodes, LC_NODES_MAX);
+	INIT_TBL(&LC.routes, LC_ROUTES_MAX);
+	INIT_TBL(&LC.broken, LC_BROKEN_MAX);
 
 	LC.src = NULL;
 
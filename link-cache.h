@@ -18,6 +18,8 @@
 struct lc_graph {
 	struct tbl nodes;
 	struct tbl links;
+	struct tbl routes;	/* Precomputed primary/backup routes */
+	struct tbl broken;	/* Recently broken links */
 	struct lc_node *src;
 #ifdef __KERNEL__
 	struct timer_list timer;
@@ -40,10 +42,19 @@ int lc_link_add(struct in_addr src, struct in_addr dst,
 void lc_garbage_collect_set(void);
 void lc_garbage_collect(unsigned long data);
 struct dsr_srt *lc_srt_find(struct in_addr src, struct in_addr dst);
+struct dsr_srt *lc_srt_find_partial(struct in_addr src, struct in_addr dst,
+				    unsigned int max_hops);
 int lc_srt_add(struct dsr_srt *srt, unsigned long timeout,
 	       unsigned short flags);
 void lc_flush(void);
+struct lc_node *__dijkstra_run(struct in_addr src, do_t relax);
 void __dijkstra(struct in_addr src);
+struct dsr_srt *__lc_srt_extract(struct in_addr src, struct in_addr dst);
+struct dsr_srt *__lc_srt_find_backup(struct dsr_srt *primary);
+void __lc_srt_exclude(struct dsr_srt *srt, int exclude);
+void __lc_routes_link_add(struct in_addr src, struct in_addr dst);
+void __lc_routes_link_del(struct in_addr src, struct in_addr dst);
+void __lc_routes_flush(void);
 int lc_init(void);
 void lc_cleanup(void);
 
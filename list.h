@@ -628,6 +628,11 @@ static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
 	n->pprev = &h->first;
 }
 
+/* There are no concurrent readers at user level, so the RCU variants are
+ * the plain operations */
+#define hlist_add_head_rcu(n, h) hlist_add_head(n, h)
+#define hlist_del_rcu(n) hlist_del(n)
+
 /* next must be != NULL */
 static inline void hlist_add_before(struct hlist_node *n,
 					struct hlist_node *next)
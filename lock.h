@@ -88,6 +88,13 @@ typedef pthread_mutex_t rwlock_t;
 #define local_bh_disable()
 #define local_bh_enable()
 
+#define rcu_read_lock()
+#define rcu_read_unlock()
+#define rcu_read_lock_bh()
+#define rcu_read_unlock_bh()
+#define rcu_dereference(p) (p)
+#define rcu_assign_pointer(p, v) ((p) = (v))
+
 #endif /* __KERNEL__ */
 
 #endif /* __LOCK_H__ */
@@ -22,6 +22,7 @@
 #include "dsr-ack.h"
 #include "link-cache.h"
 #include "dsr-rerr.h"
+#include "dsr-rreq.h"
 #include "dsr-dev.h"
 #include "dsr-srt.h"
 #include "dsr-opt.h"
@@ -31,8 +32,10 @@
 #define MAINT_BUF_PROC_FS_NAME "maint_buf"
 
 TBL(maint_buf, MAINT_BUF_MAX_LEN);
+static TBL(repair_buf, REPAIR_BUF_MAX_LEN);
 
 static DSRUUTimer ack_timer;
+static DSRUUTimer repair_timer;
 
 #endif /* NS2 */
 
@@ -47,6 +50,17 @@ struct maint_entry {
 	struct dsr_pkt *dp;
 };
 
+/* A packet that could not be salvaged, held while a local route discovery
+ * for its destination is under way */
+struct repair_entry {
+	list_t l;
+	struct in_addr dst;
+	struct in_addr nxt_hop;	/* The next hop that could not be reached */
+	int rerr;		/* A RERR is still owed to the source */
+	struct timeval expires;
+	struct dsr_pkt *dp;
+};
+
 struct maint_buf_query {
 	struct in_addr *nxt_hop;
 	unsigned short *id;
@@ -123,6 +137,18 @@ static inline int crit_addr(void *pos, void *data)
 	return 0;
 }
 
+/* Criteria function for held packets based on destination */
+static inline int crit_repair_dst(void *pos, void *data)
+{
+	struct repair_entry *r = (struct repair_entry *)pos;
+	struct in_addr *dst = (struct in_addr *)data;
+
+	if (r->dst.s_addr == dst->s_addr)
+		return 1;
+
+	return 0;
+}
+
 /* Criteria function for buffered packets based on expire time */
 static inline int crit_expires(void *pos, void *data)
 {
@@ -174,7 +200,19 @@ static struct maint_entry *maint_entry_create(struct dsr_pkt *dp,
 	if (dp->p)
 		m->dp = dsr_pkt_alloc(dp->p->copy());
 #else
-	m->dp = dsr_pkt_alloc(skb_copy(dp->skb, GFP_ATOMIC));
+	/* Share the data, dsr_skb_reuse() unshares the headers before it
+	 * rewrites them */
+	m->dp = NULL;
+	if (dp->skb) {
+		struct sk_buff *skb = skb_clone(dp->skb, GFP_ATOMIC);
+
+		if (skb) {
+			m->dp = dsr_pkt_alloc(skb);
+
+			if (!m->dp)
+				kfree_skb(skb);
+		}
+	}
 #endif
 	if (!m->dp) {
 		kfree(m);
@@ -195,7 +233,8 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 	
 	if (dp->srt) {
 		LOG_DBG("old internal source route exists\n");
-		kfree(dp->srt);
+		dsr_srt_put(dp->srt);
+		dp->srt = NULL;
 	}
 
 	alt_srt = dsr_rtc_find(my_addr(), dp->dst);
@@ -207,7 +246,7 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 	
 	if (!dp->srt_opt) {
 		LOG_DBG("No old source route\n");
-		kfree(alt_srt);
+		dsr_srt_put(alt_srt);
 		return -1;
 	}
 
@@ -215,7 +254,7 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 			      (char *)dp->srt_opt->addrs);
 
 	if (!old_srt) {
-		kfree(alt_srt);
+		dsr_srt_put(alt_srt);
 		return -1;
 	}
 
@@ -240,8 +279,8 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 		srt_to_me = dsr_srt_new_split(old_srt, my_addr());
 		
 		if (!srt_to_me) { 
-			kfree(alt_srt);
-			kfree(old_srt);
+			dsr_srt_put(alt_srt);
+			dsr_srt_put(old_srt);
 			return -1;
 		}
 		srt = dsr_srt_concatenate(srt_to_me, alt_srt);
@@ -251,11 +290,11 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 		LOG_DBG("old_srt: %s\n", print_srt(old_srt));
 		LOG_DBG("alt_srt: %s\n", print_srt(alt_srt));
 		
-		kfree(alt_srt);
-		kfree(srt_to_me);
+		dsr_srt_put(alt_srt);
+		dsr_srt_put(srt_to_me);
 	}
 
-	kfree(old_srt);
+	dsr_srt_put(old_srt);
 		
 	if (!srt)
 		return -1;
@@ -264,7 +303,7 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 
 	if (dsr_srt_check_duplicate(srt)) {
 		LOG_DBG("Duplicate address in new source route, aborting salvage\n");
-		kfree(srt);
+		dsr_srt_put(srt);
 		return -1;
 	}
 	
@@ -304,7 +343,7 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 		buf = dsr_pkt_alloc_opts(dp, new_opt_len);
 		
 		if (!buf) {
-			kfree(srt);
+			dsr_srt_put(srt);
 			return -1;
 		}
 				
@@ -347,6 +386,151 @@ int NSCLASS maint_buf_salvage(struct dsr_pkt *dp)
 	return 0;
 }
 
+/* Hold a packet that cannot be salvaged for lack of a route, and look for a
+ * route with a small route discovery of our own. Returns 0 if the packet is
+ * held, in which case a RERR (if rerr is set) is only sent once the repair
+ * succeeds or times out. */
+int NSCLASS maint_buf_repair_hold(struct dsr_pkt *dp, struct in_addr nxt_hop,
+				  int rerr)
+{
+	struct repair_entry *r;
+	struct dsr_srt *srt;
+	int pending;
+
+	if (!ConfVal(LocalRepairTTL) || !dp || !dp->srt_opt)
+		return -1;
+
+	/* Plain salvaging will do if we have a route */
+	srt = dsr_rtc_find(my_addr(), dp->dst);
+
+	if (srt) {
+		dsr_srt_put(srt);
+		return -1;
+	}
+
+	r = (struct repair_entry *)kmalloc(sizeof(struct repair_entry),
+					   GFP_ATOMIC);
+
+	if (!r)
+		return -1;
+
+	r->dst = dp->dst;
+	r->nxt_hop = nxt_hop;
+	r->rerr = rerr;
+	r->dp = dp;
+	gettime(&r->expires);
+	timeval_add_usecs(&r->expires, ConfValToUsecs(LocalRepairTimeout));
+
+	write_lock_bh(&repair_buf.lock);
+
+	if (TBL_FULL(&repair_buf)) {
+		write_unlock_bh(&repair_buf.lock);
+		kfree(r);
+		return -1;
+	}
+
+	pending = (__tbl_find(&repair_buf, &r->dst, crit_repair_dst) != NULL);
+
+	__tbl_add_tail(&repair_buf, &r->l);
+
+	if (!timer_pending(&repair_timer))
+		__repair_buf_set_timeout();
+
+	write_unlock_bh(&repair_buf.lock);
+
+	/* One request per destination is enough */
+	if (!pending) {
+		LOG_DBG("Local repair for %s\n", print_ip(r->dst));
+		dsr_rreq_send(r->dst, ConfVal(LocalRepairTTL));
+	}
+
+	return 0;
+}
+
+/* Salvage a held packet if a route has turned up, otherwise drop it */
+void NSCLASS maint_buf_repair_release(struct dsr_pkt *dp,
+				      struct in_addr nxt_hop, int rerr)
+{
+	if (rerr)
+		dsr_rerr_send(dp, nxt_hop);
+
+	if (maint_buf_salvage(dp) < 0) {
+		LOG_DBG("Local repair for %s failed\n", print_ip(dp->dst));
+#ifdef NS2
+		if (dp->p)
+			drop(dp->p, DROP_RTR_SALVAGE);
+#endif
+		dsr_pkt_free(dp);
+	}
+}
+
+/* A route to dst was found, salvage the packets held for it */
+void NSCLASS maint_buf_repair_send(struct in_addr dst)
+{
+	TBL(held, REPAIR_BUF_MAX_LEN);
+	struct repair_entry *r;
+
+	write_lock_bh(&repair_buf.lock);
+
+	while ((r = (struct repair_entry *)__tbl_find_detach(&repair_buf,
+							      &dst,
+							      crit_repair_dst)))
+		__tbl_add_tail(&held, &r->l);
+
+	write_unlock_bh(&repair_buf.lock);
+
+	/* Transmit without the lock, salvaging may end up in the
+	 * maintenance buffer */
+	while ((r = (struct repair_entry *)__tbl_detach_first(&held))) {
+		maint_buf_repair_release(r->dp, r->nxt_hop, r->rerr);
+		kfree(r);
+	}
+}
+
+void NSCLASS maint_buf_repair_timeout(unsigned long data)
+{
+	TBL(expired, REPAIR_BUF_MAX_LEN);
+	struct repair_entry *r;
+	struct timeval now;
+
+	gettime(&now);
+
+	write_lock_bh(&repair_buf.lock);
+
+	while (!TBL_EMPTY(&repair_buf)) {
+		r = (struct repair_entry *)TBL_FIRST(&repair_buf);
+
+		if (timeval_diff(&r->expires, &now) > 0)
+			break;
+
+		__tbl_detach(&repair_buf, &r->l);
+		__tbl_add_tail(&expired, &r->l);
+	}
+
+	if (!TBL_EMPTY(&repair_buf))
+		__repair_buf_set_timeout();
+
+	write_unlock_bh(&repair_buf.lock);
+
+	while ((r = (struct repair_entry *)__tbl_detach_first(&expired))) {
+		maint_buf_repair_release(r->dp, r->nxt_hop, r->rerr);
+		kfree(r);
+	}
+}
+
+/* Entries are held for the same time, so the first one expires first */
+void NSCLASS __repair_buf_set_timeout(void)
+{
+	struct repair_entry *r;
+
+	r = (struct repair_entry *)TBL_FIRST(&repair_buf);
+
+	repair_timer.function = &NSCLASS maint_buf_repair_timeout;
+	repair_timer.data = 0;
+
+	set_timer(&repair_timer, &r->expires);
+}
+
 void NSCLASS maint_buf_timeout(unsigned long data)
 {
         write_lock_bh(&maint_buf.lock);
@@ -391,22 +575,30 @@ void NSCLASS _maint_buf_timeout(unsigned long data)
 				Packet::free(qp);
 			}
 #endif			
-			dsr_rerr_send(m->dp, m->nxt_hop);
+			/* Without a route to salvage with, try to repair
+			 * locally before giving up */
+			if (maint_buf_repair_hold(m->dp, m->nxt_hop, 1) == 0)
+				n++;
+			else {
+				dsr_rerr_send(m->dp, m->nxt_hop);
 
-			/* Salvage timed out packet */
-			if (maint_buf_salvage(m->dp) < 0) {
+				/* Salvage timed out packet */
+				if (maint_buf_salvage(m->dp) < 0) {
 #ifdef NS2
-				if (m->dp->p) 
-					drop(m->dp->p, DROP_RTR_SALVAGE);
+					if (m->dp->p) 
+						drop(m->dp->p, DROP_RTR_SALVAGE);
 #endif
-				dsr_pkt_free(m->dp);
-			} else
-				n++;
+					dsr_pkt_free(m->dp);
+				} else
+					n++;
+			}
 			/* Salvage other packets in maintenance buffer with the
 			 * same next hop */
 			while ((m2 = (struct maint_entry *)__tbl_find_detach(&maint_buf, &m->nxt_hop, crit_addr))) {
 				
-				if (maint_buf_salvage(m2->dp) < 0) {
+				if (maint_buf_salvage(m2->dp) < 0 &&
+				    maint_buf_repair_hold(m2->dp, m->nxt_hop,
+							  0) < 0) {
 #ifdef NS2
 					if (m2->dp->p)
 						drop(m2->dp->p, DROP_RTR_SALVAGE);
@@ -776,8 +968,10 @@ int NSCLASS maint_buf_init(void)
 #endif
 #endif
 	INIT_TBL(&maint_buf, MAINT_BUF_MAX_LEN);
+	INIT_TBL(&repair_buf, REPAIR_BUF_MAX_LEN);
 
 	init_timer(&ack_timer);
+	init_timer(&repair_timer);
 
 	ack_timer.function = &NSCLASS maint_buf_timeout;
 	ack_timer.expires = 0;
@@ -785,13 +979,26 @@ int NSCLASS maint_buf_init(void)
 	return 1;
 }
 
+/* Stop the maintenance timers, so that no more RREQs or RERRs are sent
+ * while the other tables are torn down. The two timers can arm each other,
+ * so keep going until both stay stopped. */
+void NSCLASS maint_buf_timers_stop(void)
+{
+	do {
+		del_timer_sync(&ack_timer);
+		del_timer_sync(&repair_timer);
+	} while (timer_pending(&ack_timer) || timer_pending(&repair_timer));
+}
+
 void NSCLASS maint_buf_cleanup(void)
 {
 	struct maint_entry *m;
+	struct repair_entry *r;
 
-	write_lock_bh(&maint_buf.lock);
+	/* The timer handlers take the buffer locks */
+	maint_buf_timers_stop();
 
-	del_timer_sync(&ack_timer);
+	write_lock_bh(&maint_buf.lock);
 
 	while ((m = (struct maint_entry *)__tbl_detach_first(&maint_buf))) {
 #ifdef NS2
@@ -805,6 +1012,20 @@ void NSCLASS maint_buf_cleanup(void)
 
 	write_unlock_bh(&maint_buf.lock);
 
+	write_lock_bh(&repair_buf.lock);
+
+	while ((r = (struct repair_entry *)__tbl_detach_first(&repair_buf))) {
+#ifdef NS2
+		if (r->dp->p)
+			Packet::free(r->dp->p);
+#endif
+		dsr_pkt_free(r->dp);
+
+		kfree(r);
+	}
+
+	write_unlock_bh(&repair_buf.lock);
+
 #ifdef __KERNEL__
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
 	proc_net_remove(MAINT_BUF_PROC_FS_NAME);
@@ -12,6 +12,7 @@
 
 int maint_buf_init(void);
 void maint_buf_cleanup(void);
+void maint_buf_timers_stop(void);
 
 void maint_buf_set_max_len(unsigned int max_len);
 int maint_buf_add(struct dsr_pkt *dp);
@@ -23,6 +24,13 @@ void _maint_buf_set_timeout(void);
 void maint_buf_timeout(unsigned long data);
 void _maint_buf_timeout(unsigned long data);
 int maint_buf_salvage(struct dsr_pkt *dp);
+int maint_buf_repair_hold(struct dsr_pkt *dp, struct in_addr nxt_hop,
+			  int rerr);
+void maint_buf_repair_release(struct dsr_pkt *dp, struct in_addr nxt_hop,
+			      int rerr);
+void maint_buf_repair_send(struct in_addr dst);
+void maint_buf_repair_timeout(unsigned long data);
+void __repair_buf_set_timeout(void);
 
 #endif				/* NO_DECLS */
 
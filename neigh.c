@@ -32,8 +32,11 @@
 #define RTT_SHIFT 3
 #define RTTVAR_SHIFT 2
 
+/* Interval (msecs) between scans for neighbors that have not been heard
+ * for longer than the route cache timeout */
 #define NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT 3000
-#define NEIGH_TBL_TIMEOUT 2000
+
+#define NEIGH_HH_DATA_MAX 32	/* Largest link layer header we cache */
 
 #define DSR_RANGESET(tv, value, tvmin, tvmax) { \
         (tv) = (value); \
@@ -49,130 +52,173 @@
         (((val) >> RTT_SHIFT) + (val))
 
 #ifdef __KERNEL__
-static TBL(neigh_tbl, NEIGH_TBL_MAX_LEN);
+static struct neigh_hash_tbl neigh_tbl;
+/* Bumped by neigh_tbl_hh_flush(), so that headers built before a flush are
+ * not cached after it. Protected by the table lock. */
+static unsigned int neigh_hh_gen;
 
 #define NEIGH_TBL_PROC_NAME "dsr_neigh_tbl"
 
 static DSRUUTimer neigh_tbl_timer;
 #endif
 
-
+/* Neighbors are kept in a hash table. Lookups, which are done for every
+ * transmitted packet, run under RCU (kernel) without taking the table lock,
+ * while additions, removals and updates are serialized by the table
+ * spinlock. */
 struct neighbor {
-	list_t l;
+	struct hlist_node node;	/* Must be first */
 	struct in_addr addr;
 	struct sockaddr hw_addr;
 	unsigned short id;
 	struct timeval last_ack_req;
+	struct timeval last_heard;
 	usecs_t t_srtt, rto, t_rxtcur, t_rttmin, t_rttvar, jitter;	/* RTT in usec */
+#ifdef __KERNEL__
+	struct rcu_head rcu;
+	/* Prebuilt link layer header for packets to this neighbor, filled in
+	 * from the first transmitted packet. hh_len is zero when no header
+	 * is cached. hh_lock also covers hw_addr. */
+	seqlock_t hh_lock;
+	unsigned short hh_len;
+	unsigned char hh_data[NEIGH_HH_DATA_MAX];
+#endif
 };
 
-struct neighbor_query {
-	struct in_addr *addr;
-	struct neighbor_info *info;
-};
+static inline unsigned int neigh_hash(struct in_addr addr)
+{
+	unsigned int a = addr.s_addr;
 
-static inline int crit_addr(void *pos, void *query)
+	return (a ^ (a >> 8) ^ (a >> 16) ^ (a >> 24)) &
+	    (NEIGH_TBL_HASH_SIZE - 1);
+}
+
+#ifdef __KERNEL__
+static void neigh_rcu_free(struct rcu_head *head)
 {
-	struct neighbor_query *q = (struct neighbor_query *)query;
-	struct neighbor *n = (struct neighbor *)pos;
-	usecs_t rto;
+	kfree(container_of(head, struct neighbor, rcu));
+}
+#define neigh_free(n) call_rcu(&(n)->rcu, neigh_rcu_free)
+#else
+#define neigh_free(n) kfree(n)
+#endif
 
-	if (n->addr.s_addr == q->addr->s_addr) {
-		if (q->info) {
-			
-			q->info->id = n->id;
-			q->info->last_ack_req = n->last_ack_req;
-			memcpy(&q->info->hw_addr, &n->hw_addr,
-			       sizeof(struct sockaddr));
-			
-			rto = ConfValToUsecs(RoundTripTimeout);
-		
-			/* Return current RTO */
-			if (rto == 0) {
-				q->info->rto = n->t_rxtcur * 1000 / PR_SLOWHZ;
-			} else {
-				/* Fixed RTO (defaults to 2 secs) */
-				q->info->rto = rto;
-			}
-		}
-		return 1;
+/* Must be called with either the table lock or the RCU read lock held */
+struct neighbor *NSCLASS __neigh_tbl_find(struct in_addr addr)
+{
+	struct hlist_node *pos;
+
+	for (pos = rcu_dereference(neigh_tbl.hash[neigh_hash(addr)].first);
+	     pos; pos = rcu_dereference(pos->next)) {
+		struct neighbor *n = (struct neighbor *)pos;
+
+		if (n->addr.s_addr == addr.s_addr)
+			return n;
 	}
-	return 0;
+	return NULL;
+}
+
+/* Unlink a neighbor. Must be called with the table lock held. */
+void NSCLASS __neigh_tbl_del(struct neighbor *n)
+{
+	hlist_del_rcu(&n->node);
+	neigh_tbl.len--;
+	neigh_free(n);
 }
 
-static inline int crit_addr_id_inc(void *pos, void *addr)
+/* Make room for a new neighbor by dropping the one that was heard from
+ * least recently. Must be called with the table lock held. */
+void NSCLASS __neigh_tbl_evict(void)
 {
-	struct in_addr *a = (struct in_addr *)addr;
-	struct neighbor *n = (struct neighbor *)pos;
+	struct neighbor *oldest = NULL;
+	struct hlist_node *pos;
+	int i;
+
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++) {
+		hlist_for_each(pos, &neigh_tbl.hash[i]) {
+			struct neighbor *n = (struct neighbor *)pos;
+
+			if (!oldest ||
+			    timeval_diff(&n->last_heard,
+					 &oldest->last_heard) < 0)
+				oldest = n;
+		}
+	}
 
-	if (n->addr.s_addr == a->s_addr) {
-		n->id++;
-		//gettime(&n->last_ack_req);
-		return 1;
+	if (oldest) {
+		LOG_DBG("Evicting %s\n", print_ip(oldest->addr));
+		__neigh_tbl_del(oldest);
 	}
-	return 0;
 }
-static inline int set_ack_req_time(void *pos, void *addr)
+
+static inline void neigh_rto_calc(struct neighbor *n, usecs_t rtt)
 {
-	struct in_addr *a = (struct in_addr *)addr;
-	struct neighbor *n = (struct neighbor *)pos;
+	int delta;
+
+	/* Should verify for sure that this does the right
+	 * thing... */
+	if (n->t_srtt != 0) {
+		delta = rtt - 1 - (n->t_srtt >> RTT_SHIFT);
+
+		if ((n->t_srtt += delta) <= 0)
+			n->t_srtt = 1;
 
-	if (n->addr.s_addr == a->s_addr) {
-		gettime(&n->last_ack_req);
-		return 1;
+		if (delta < 0)
+			delta = -delta;
+
+		delta -= (n->t_rttvar >> RTTVAR_SHIFT);
+
+		if ((n->t_rttvar += delta) <= 0)
+			n->t_rttvar = 1;
+	} else {
+		n->t_srtt = rtt << RTT_SHIFT;
+		n->t_rttvar = rtt << (RTTVAR_SHIFT - 1);
 	}
-	return 0;
+
+	DSR_RANGESET(n->t_rxtcur, DSR_REXMTVAL(n->t_srtt),
+		     n->t_rttmin, DSR_REXMTMAX);
 }
 
-static inline int rto_calc(void *pos, void *query)
+void NSCLASS neigh_tbl_garbage_timeout_set(void)
 {
-	struct neighbor_query *q = (struct neighbor_query *)query;
-	struct neighbor *n = (struct neighbor *)pos;
-	
-	if (n->addr.s_addr == q->addr->s_addr) {
-		struct timeval now;
-		usecs_t rtt = q->info->rtt;
-		int delta;
-		
-		gettime(&now);
-		
-		/* Should verify for sure that this does the right
-		 * thing... */
-		if (n->t_srtt != 0) {
-			delta = rtt - 1 - (n->t_srtt >> RTT_SHIFT);
-			
-			if ((n->t_srtt += delta) <= 0)
-				n->t_srtt = 1;
-			
-			if (delta < 0)
-				delta = -delta;
-			
-			delta -= (n->t_rttvar >> RTTVAR_SHIFT);
-			
-			if ((n->t_rttvar += delta) <= 0)
-				n->t_rttvar = 1;
-		} else {
-			n->t_srtt = rtt << RTT_SHIFT;
-			n->t_rttvar = rtt << (RTTVAR_SHIFT - 1);
-		}
-		
-		DSR_RANGESET(n->t_rxtcur, DSR_REXMTVAL(n->t_srtt),
-			     n->t_rttmin, DSR_REXMTMAX);
-		
-		return 1;
-	}
-	return 0;
+	struct timeval expires;
+
+	gettime(&expires);
+	timeval_add_usecs(&expires, NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT * 1000);
+
+	set_timer(&neigh_tbl_timer, &expires);
 }
-/* TODO: Implement neighbor table garbage collection */
+
+/* Remove neighbors that have not been heard from in a route cache timeout.
+ * Any link to them would have expired from the cache by then, so their
+ * hardware addresses are no longer needed. */
 void NSCLASS neigh_tbl_garbage_timeout(unsigned long data)
 {
-	/* tbl_for_each_del(&neigh_tbl, NULL, crit_garbage); */
+	struct hlist_node *pos, *tmp;
+	struct timeval now;
+	usecs_t timeout = ConfValToUsecs(RouteCacheTimeout);
+	int i;
+
+	gettime(&now);
 
-/* 	if (!tbl_empty(&neigh_tbl)) { */
-	/*      garbage_timer.expires = TimeNow +  */
-/* 			MSECS_TO_TIMENOW(NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT); */
-	/*      add_timer(&garbage_timer);       */
-	/* } */
+	spin_lock_bh(&neigh_tbl.lock);
+
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++) {
+		hlist_for_each_safe(pos, tmp, &neigh_tbl.hash[i]) {
+			struct neighbor *n = (struct neighbor *)pos;
+
+			if (timeval_diff(&now, &n->last_heard) >= (long)timeout) {
+				LOG_DBG("Neighbor %s timed out\n",
+					print_ip(n->addr));
+				__neigh_tbl_del(n);
+			}
+		}
+	}
+
+	if (neigh_tbl.len)
+		neigh_tbl_garbage_timeout_set();
+
+	spin_unlock_bh(&neigh_tbl.lock);
 }
 
 static struct neighbor *neigh_tbl_create(struct in_addr addr,
@@ -199,9 +245,11 @@ static struct neighbor *neigh_tbl_create(struct in_addr addr,
 
 	memset(&neigh->last_ack_req, 0, sizeof(struct timeval));
 	memcpy(&neigh->hw_addr, hw_addr, sizeof(struct sockaddr));
-
-/* 	garbage_timer.expires = TimeNow + NEIGH_TBL_GARBAGE_COLLECT_TIMEOUT / 1000*HZ; */
-/* 	add_timer(&garbage_timer); */
+	gettime(&neigh->last_heard);
+#ifdef __KERNEL__
+	seqlock_init(&neigh->hh_lock);
+	neigh->hh_len = 0;
+#endif
 
 	return neigh;
 }
@@ -214,13 +262,8 @@ int NSCLASS neigh_tbl_add(struct in_addr neigh_addr, struct ethhdr *ethh)
 {
 	struct sockaddr hw_addr;
 	struct neighbor *neigh;
-	struct neighbor_query q;
-
-	q.addr = &neigh_addr;
-	q.info = NULL;
+	int res = 0;
 
-	if (in_tbl(&neigh_tbl, &q, crit_addr))
-		return 0;
 #ifdef NS2
 	/* This should probably be changed to lookup the MAC type
 	 * dynamically in case the simulation is run over a non 802.11
@@ -231,82 +274,327 @@ int NSCLASS neigh_tbl_add(struct in_addr neigh_addr, struct ethhdr *ethh)
 	int mac_src = ETHER_ADDR(mh_802_11->dh_ta);
 
 	inttoeth(&mac_src, (char *)&hw_addr);
-
-	LOG_DBG("ADD %s, %d\n", print_ip(neigh_addr), mac_src);
 #else
 	memcpy(hw_addr.sa_data, ethh->h_source, ETH_ALEN);
 #endif
 
+	spin_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_addr);
+
+	if (neigh) {
+		/* Refresh, and pick up a changed hardware address */
+		gettime(&neigh->last_heard);
+
+		if (memcmp(neigh->hw_addr.sa_data, hw_addr.sa_data, ETH_ALEN)) {
+#ifdef __KERNEL__
+			/* Lookups read the address without the table lock.
+			 * The cached header has the old address. */
+			write_seqlock(&neigh->hh_lock);
+			memcpy(&neigh->hw_addr, &hw_addr,
+			       sizeof(struct sockaddr));
+			neigh->hh_len = 0;
+			write_sequnlock(&neigh->hh_lock);
+#else
+			memcpy(&neigh->hw_addr, &hw_addr,
+			       sizeof(struct sockaddr));
+#endif
+		}
+		goto out;
+	}
+
+	LOG_DBG("ADD %s\n", print_ip(neigh_addr));
+
 	neigh = neigh_tbl_create(neigh_addr, &hw_addr, 1);
 
 	if (!neigh) {
 		LOG_DBG("Could not create new neighbor entry\n");
-		return -1;
+		res = -1;
+		goto out;
 	}
-	tbl_add(&neigh_tbl, &neigh->l, crit_none);
 
-	return 1;
+	if (neigh_tbl.len >= neigh_tbl.max_len)
+		__neigh_tbl_evict();
+
+	hlist_add_head_rcu(&neigh->node, &neigh_tbl.hash[neigh_hash(neigh_addr)]);
+	neigh_tbl.len++;
+
+	if (!timer_pending(&neigh_tbl_timer))
+		neigh_tbl_garbage_timeout_set();
+
+	res = 1;
+      out:
+	spin_unlock_bh(&neigh_tbl.lock);
+
+	return res;
 }
 
 int NSCLASS neigh_tbl_del(struct in_addr neigh_addr)
 {
-	return tbl_for_each_del(&neigh_tbl, &neigh_addr, crit_addr);
+	struct neighbor *neigh;
+	int res = 0;
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_addr);
+
+	if (neigh) {
+		__neigh_tbl_del(neigh);
+		res = 1;
+	}
+
+	spin_unlock_bh(&neigh_tbl.lock);
+
+	return res;
 }
 
 int NSCLASS neigh_tbl_set_ack_req_time(struct in_addr neigh_addr)
 {
-	return tbl_find_do(&neigh_tbl, &neigh_addr, set_ack_req_time);
+	struct neighbor *neigh;
+	int res = 0;
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_addr);
+
+	if (neigh) {
+		gettime(&neigh->last_ack_req);
+		res = 1;
+	}
+
+	spin_unlock_bh(&neigh_tbl.lock);
+
+	return res;
 }
 
 int NSCLASS 
 neigh_tbl_set_rto(struct in_addr neigh_addr, struct neighbor_info *neigh_info)
 {
-	struct neighbor_query q;
-	
-	q.addr = &neigh_addr;
-	q.info = neigh_info;
-	
-	return tbl_find_do(&neigh_tbl, &q, rto_calc);
+	struct neighbor *neigh;
+	int res = 0;
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_addr);
+
+	if (neigh) {
+		neigh_rto_calc(neigh, neigh_info->rtt);
+		/* An ACK means we have heard from the neighbor */
+		gettime(&neigh->last_heard);
+		res = 1;
+	}
+
+	spin_unlock_bh(&neigh_tbl.lock);
+
+	return res;
 }
 
 int NSCLASS
 neigh_tbl_query(struct in_addr neigh_addr, struct neighbor_info *neigh_info)
 {
-	struct neighbor_query q;
+	struct neighbor *neigh;
+	usecs_t rto;
+#ifdef __KERNEL__
+	unsigned int seq;
+#endif
+
+	rcu_read_lock_bh();
+
+	neigh = __neigh_tbl_find(neigh_addr);
+
+	if (!neigh) {
+		rcu_read_unlock_bh();
+		return 0;
+	}
+
+	if (neigh_info) {
+		neigh_info->id = neigh->id;
+		neigh_info->last_ack_req = neigh->last_ack_req;
+#ifdef __KERNEL__
+		neigh_info->hh_gen = neigh_hh_gen;
+		smp_rmb();
+
+		/* The address may change under us, see neigh_tbl_add() */
+		do {
+			seq = read_seqbegin(&neigh->hh_lock);
+			memcpy(&neigh_info->hw_addr, &neigh->hw_addr,
+			       sizeof(struct sockaddr));
+		} while (read_seqretry(&neigh->hh_lock, seq));
+#else
+		memcpy(&neigh_info->hw_addr, &neigh->hw_addr,
+		       sizeof(struct sockaddr));
+#endif
+
+		rto = ConfValToUsecs(RoundTripTimeout);
+
+		/* Return current RTO */
+		if (rto == 0) {
+			neigh_info->rto = neigh->t_rxtcur * 1000 / PR_SLOWHZ;
+		} else {
+			/* Fixed RTO (defaults to 2 secs) */
+			neigh_info->rto = rto;
+		}
+	}
 
-	q.addr = &neigh_addr;
-	q.info = neigh_info;
+	rcu_read_unlock_bh();
 
-	return in_tbl(&neigh_tbl, &q, crit_addr);
+	return 1;
 }
 
 int NSCLASS neigh_tbl_id_inc(struct in_addr neigh_addr)
 {
-	return tbl_find_do(&neigh_tbl, &neigh_addr, crit_addr_id_inc);
+	struct neighbor *neigh;
+	int res = 0;
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_addr);
+
+	if (neigh) {
+		neigh->id++;
+		res = 1;
+	}
+
+	spin_unlock_bh(&neigh_tbl.lock);
+
+	return res;
+}
+
+/* Number of neighbors currently in the table, used as a density estimate */
+unsigned int NSCLASS neigh_tbl_len(void)
+{
+	return neigh_tbl.len;
 }
 
 #ifdef __KERNEL__
-static int neigh_tbl_print(char *buf)
+/* Prepend the cached link layer header of a neighbor to a packet. Returns
+ * -1 if there is no cached header, in which case the caller must build
+ * one with dev_hard_header() and then call neigh_tbl_hh_update(). */
+int neigh_tbl_hh_output(struct in_addr neigh_addr, struct sk_buff *skb)
 {
-	list_t *pos;
-	int len = 0;
+	struct neighbor *neigh;
+	unsigned int seq;
+	int hh_len;
 
-	read_lock_bh(&neigh_tbl.lock);
+	rcu_read_lock_bh();
 
-	len +=
-	    sprintf(buf, "# %-15s %-17s %-10s %-6s\n", "Addr", "HwAddr",
-		    "RTO (usec)", "Id" /*, "AckRxTime","AckTxTime" */ );
+	neigh = __neigh_tbl_find(neigh_addr);
+
+	if (!neigh) {
+		rcu_read_unlock_bh();
+		return -1;
+	}
+
+	do {
+		seq = read_seqbegin(&neigh->hh_lock);
+		hh_len = neigh->hh_len;
+
+		if (hh_len && skb_headroom(skb) >= hh_len)
+			memcpy(skb->data - hh_len, neigh->hh_data, hh_len);
+		else
+			hh_len = 0;
+	} while (read_seqretry(&neigh->hh_lock, seq));
+
+	rcu_read_unlock_bh();
+
+	if (!hh_len)
+		return -1;
+
+	skb_push(skb, hh_len);
+	SKB_SET_MAC_HDR(skb, 0);
+
+	return 0;
+}
+
+/* Remember the link layer header just built at skb->data for a neighbor.
+ * neigh_info is what the header was built from; if the neighbor's address
+ * has changed or the headers were flushed since, it is stale and not
+ * stored. */
+int neigh_tbl_hh_update(struct in_addr neigh_addr,
+			struct neighbor_info *neigh_info, struct sk_buff *skb,
+			int hh_len)
+{
+	struct neighbor *neigh;
+	int res = 0;
+
+	if (hh_len <= 0 || hh_len > NEIGH_HH_DATA_MAX)
+		return 0;
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	neigh = __neigh_tbl_find(neigh_addr);
 
-	list_for_each(pos, &neigh_tbl.head) {
-		struct neighbor *neigh = (struct neighbor *)pos;
+	if (neigh && neigh_info->hh_gen == neigh_hh_gen) {
+		write_seqlock(&neigh->hh_lock);
 
-		len += sprintf(buf + len, "  %-15s %-17s %-10lu %-6u\n",
-			       print_ip(neigh->addr),
-			       print_eth(neigh->hw_addr.sa_data),
-			       neigh->t_rxtcur, neigh->id);
+		if (memcmp(neigh->hw_addr.sa_data, neigh_info->hw_addr.sa_data,
+			   ETH_ALEN) == 0) {
+			memcpy(neigh->hh_data, skb->data, hh_len);
+			neigh->hh_len = hh_len;
+			res = 1;
+		}
+		write_sequnlock(&neigh->hh_lock);
 	}
 
-	read_unlock_bh(&neigh_tbl.lock);
+	spin_unlock_bh(&neigh_tbl.lock);
+
+	return res;
+}
+
+/* Invalidate all cached link layer headers, e.g., when the address of the
+ * slave device changes */
+void neigh_tbl_hh_flush(void)
+{
+	struct hlist_node *pos;
+	int i;
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	neigh_hh_gen++;
+
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++) {
+		hlist_for_each(pos, &neigh_tbl.hash[i]) {
+			struct neighbor *neigh = (struct neighbor *)pos;
+
+			write_seqlock(&neigh->hh_lock);
+			neigh->hh_len = 0;
+			write_sequnlock(&neigh->hh_lock);
+		}
+	}
+
+	spin_unlock_bh(&neigh_tbl.lock);
+}
+
+static int neigh_tbl_print(char *buf)
+{
+	struct hlist_node *pos;
+	struct timeval now;
+	int len = 0, i;
+
+	gettime(&now);
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	len +=
+	    sprintf(buf, "# %-15s %-17s %-10s %-6s %s\n", "Addr", "HwAddr",
+		    "RTO (usec)", "Id", "Heard (s)");
+
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++) {
+		hlist_for_each(pos, &neigh_tbl.hash[i]) {
+			struct neighbor *neigh = (struct neighbor *)pos;
+
+			len += sprintf(buf + len,
+				       "  %-15s %-17s %-10lu %-6u %lu\n",
+				       print_ip(neigh->addr),
+				       print_eth(neigh->hw_addr.sa_data),
+				       neigh->t_rxtcur, neigh->id,
+				       timeval_diff(&now,
+						    &neigh->last_heard) /
+				       1000000);
+		}
+	}
+
+	spin_unlock_bh(&neigh_tbl.lock);
 	return len;
 }
 
@@ -329,24 +617,31 @@ neigh_tbl_proc_info(char *buffer, char **start, off_t offset, int length, int *e
 /* Similar to above function, for using with proc_create() */
 static int neigh_tbl_proc_show(struct seq_file *m, void *v)
 {
-	list_t *pos;
-	int len = 0;
+	struct hlist_node *pos;
+	struct timeval now;
+	int i;
+
+	gettime(&now);
 
-	read_lock_bh(&neigh_tbl.lock);
+	spin_lock_bh(&neigh_tbl.lock);
 
-	seq_printf(m, "# %-15s %-17s %-10s %-6s\n", "Addr", "HwAddr",
-		    "RTO (usec)", "Id" /*, "AckRxTime","AckTxTime" */ );
+	seq_printf(m, "# %-15s %-17s %-10s %-6s %s\n", "Addr", "HwAddr",
+		   "RTO (usec)", "Id", "Heard (s)");
 
-	list_for_each(pos, &neigh_tbl.head) {
-		struct neighbor *neigh = (struct neighbor *)pos;
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++) {
+		hlist_for_each(pos, &neigh_tbl.hash[i]) {
+			struct neighbor *neigh = (struct neighbor *)pos;
 
-		seq_printf(m, "  %-15s %-17s %-10lu %-6u\n",
-			       print_ip(neigh->addr),
-			       print_eth(neigh->hw_addr.sa_data),
-			       neigh->t_rxtcur, neigh->id);
+			seq_printf(m, "  %-15s %-17s %-10lu %-6u %lu\n",
+				   print_ip(neigh->addr),
+				   print_eth(neigh->hw_addr.sa_data),
+				   neigh->t_rxtcur, neigh->id,
+				   timeval_diff(&now, &neigh->last_heard) /
+				   1000000);
+		}
 	}
 
-	read_unlock_bh(&neigh_tbl.lock);
+	spin_unlock_bh(&neigh_tbl.lock);
 	return 0;
 }
 
@@ -365,6 +660,7 @@ static const struct file_operations neigh_tbl_proc_fops = {
 
 int __init NSCLASS neigh_tbl_init(void)
 {
+	int i;
 #ifdef __KERNEL__
 	struct proc_dir_entry *proc;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,23))
@@ -383,18 +679,40 @@ int __init NSCLASS neigh_tbl_init(void)
 	if (!proc)
 		return -1;
 #endif
-	INIT_TBL(&neigh_tbl, NEIGH_TBL_MAX_LEN);
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&neigh_tbl.hash[i]);
+
+	neigh_tbl.len = 0;
+	neigh_tbl.max_len = NEIGH_TBL_MAX_LEN;
+	spin_lock_init(&neigh_tbl.lock);
 
 	init_timer(&neigh_tbl_timer);
 
 	neigh_tbl_timer.function = &NSCLASS neigh_tbl_garbage_timeout;
+	neigh_tbl_timer.data = 0;
 
 	return 0;
 }
 
 void __exit NSCLASS neigh_tbl_cleanup(void)
 {
-	tbl_flush(&neigh_tbl, crit_none);
+	struct hlist_node *pos, *tmp;
+	int i;
+
+	del_timer_sync(&neigh_tbl_timer);
+
+	spin_lock_bh(&neigh_tbl.lock);
+
+	for (i = 0; i < NEIGH_TBL_HASH_SIZE; i++)
+		hlist_for_each_safe(pos, tmp, &neigh_tbl.hash[i])
+			__neigh_tbl_del((struct neighbor *)pos);
+
+	spin_unlock_bh(&neigh_tbl.lock);
+
+#ifdef __KERNEL__
+	/* Wait for pending RCU frees before the module goes away */
+	rcu_barrier();
+#endif
 
 #ifdef __KERNEL__
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24))
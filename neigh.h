@@ -16,11 +16,24 @@
 
 #ifndef NO_GLOBALS
 
+#define NEIGH_TBL_HASH_SIZE 16	/* Must be a power of two */
+
+struct neigh_hash_tbl {
+	struct hlist_head hash[NEIGH_TBL_HASH_SIZE];
+	unsigned int len, max_len;
+	spinlock_t lock;
+};
+
+struct neighbor;
+
 struct neighbor_info {
 	struct sockaddr hw_addr;
 	unsigned short id;
 	usecs_t rtt, rto;		/* RTT and Round Trip Timeout */
 	struct timeval last_ack_req;
+#ifdef __KERNEL__
+	unsigned int hh_gen;	/* See neigh_tbl_hh_update() */
+#endif
 };
 
 #endif				/* NO_GLOBALS */
@@ -35,9 +48,21 @@ int neigh_tbl_del(struct in_addr neigh_addr);
 int neigh_tbl_query(struct in_addr neigh_addr,
 		    struct neighbor_info *neigh_info);
 int neigh_tbl_id_inc(struct in_addr neigh_addr);
+unsigned int neigh_tbl_len(void);
 int neigh_tbl_set_rto(struct in_addr neigh_addr, struct neighbor_info *neigh_info);
 int neigh_tbl_set_ack_req_time(struct in_addr neigh_addr);
+#ifdef __KERNEL__
+int neigh_tbl_hh_output(struct in_addr neigh_addr, struct sk_buff *skb);
+int neigh_tbl_hh_update(struct in_addr neigh_addr,
+			struct neighbor_info *neigh_info, struct sk_buff *skb,
+			int hh_len);
+void neigh_tbl_hh_flush(void);
+#endif
 void neigh_tbl_garbage_timeout(unsigned long data);
+void neigh_tbl_garbage_timeout_set(void);
+struct neighbor *__neigh_tbl_find(struct in_addr addr);
+void __neigh_tbl_del(struct neighbor *n);
+void __neigh_tbl_evict(void);
 
 int neigh_tbl_init(void);
 void neigh_tbl_cleanup(void);
@@ -1387,3 +1387,18 @@ Agent/DSRUU set TryPassiveAcks_ 1
 Agent/DSRUU set PassiveAckTimeout_ 100
 Agent/DSRUU set GratReplyHoldOff_ 1
 Agent/DSRUU set MAX_SALVAGE_COUNT_ 15
+Agent/DSRUU set RREQSuppressThreshold_ 0
+Agent/DSRUU set RREQRateLimit_ 0
+Agent/DSRUU set RREQBurst_ 10
+Agent/DSRUU set RREQTargetRateLimit_ 0
+Agent/DSRUU set RREQTargetBurst_ 3
+Agent/DSRUU set RREQCoalesceWindow_ 0
+Agent/DSRUU set RREQPiggybackMaxLen_ 0
+Agent/DSRUU set LocalDiscoveryTTL_ 0
+Agent/DSRUU set LocalRepairTTL_ 0
+Agent/DSRUU set LocalRepairTimeout_ 250
+Agent/DSRUU set RREPWindow_ 0
+Agent/DSRUU set CachedReplyDelay_ 0
+Agent/DSRUU set RERRCoalesceWindow_ 0
+Agent/DSRUU set RREQErrorHoldTime_ 0
+Agent/DSRUU set FlowStateTimeout_ 0
@@ -36,7 +36,12 @@ int DSRUU::confvals[CONFVAL_MAX];
 DSRUU::DSRUU() : Agent(PT_DSR), 
 		 ack_timer(this, "ACKTimer"), 
 		 grat_rrep_tbl_timer(this, "GratRREPTimer"), 
+		 rrep_delay_timer(this, "RREPDelayTimer"), 
+		 rreq_fwd_timer(this, "RREQFwdTimer"), 
+		 rreq_coalesce_timer(this, "RREQCoalesceTimer"), 
 		 send_buf_timer(this, "SendBufTimer"), 
+		 repair_timer(this, "RepairTimer"), 
+		 rerr_tbl_timer(this, "RERRTimer"), 
 		 neigh_tbl_timer(this, "NeighTblTimer"), 
 		 lc_timer(this, "LinkCacheTimer")
 {
@@ -68,6 +73,8 @@ DSRUU::DSRUU() : Agent(PT_DSR),
 	neigh_tbl_init();
 	rreq_tbl_init();
 	grat_rrep_tbl_init();
+	rerr_tbl_init();
+	flow_tbl_init();
 	maint_buf_init();
 	send_buf_init();
 	
@@ -82,6 +89,8 @@ DSRUU::~DSRUU()
 	neigh_tbl_cleanup();
 	rreq_tbl_cleanup();
 	grat_rrep_tbl_cleanup();
+	rerr_tbl_cleanup();
+	flow_tbl_cleanup();
 	send_buf_cleanup();
  	maint_buf_cleanup();
 
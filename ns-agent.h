@@ -44,6 +44,7 @@ class DSRUU;
 #include "dsr-pkt.h"
 #include "dsr-rrep.h"
 #include "dsr-rerr.h"
+#include "dsr-flow.h"
 #include "dsr-ack.h"
 #include "dsr-srt.h"
 #include "neigh.h"
@@ -142,6 +143,9 @@ class DSRUU:public Tap, public Agent {
 #undef _DSR_RERR_H
 #include "dsr-rerr.h"
 
+#undef _DSR_FLOW_H
+#include "dsr-flow.h"
+
 #undef _DSR_ACK_H
 #include "dsr-ack.h"
 
@@ -188,15 +192,33 @@ class DSRUU:public Tap, public Agent {
 	MobileNode *node_;
 
 	struct tbl rreq_tbl;
+	struct hlist_head rreq_id_hash[RREQ_ID_HASH_SIZE];
+	struct tbl rreq_fwd_tbl;
+	struct rreq_bucket rreq_bucket;
+	struct rreq_stats rreq_stats;
+	int rreq_diameter;
+	struct rreq_coalesce rreq_coalesce;
 	struct tbl grat_rrep_tbl;
+	struct grat_rrep_entry *grat_rrep_hash[GRAT_RREP_HASH_SIZE];
+	struct tbl rrep_delay_tbl;
 	struct tbl send_buf;
-	struct tbl neigh_tbl;
+	struct neigh_hash_tbl neigh_tbl;
 	struct tbl maint_buf;
+	struct tbl repair_buf;
+	struct tbl rerr_tbl;
+	struct rerr_recent rerr_recent;
+	struct tbl flow_tbl;
+	unsigned short flow_id;
 
 	unsigned int rreq_seqno;
 
 	DSRUUTimer grat_rrep_tbl_timer;
+	DSRUUTimer rrep_delay_timer;
+	DSRUUTimer rreq_fwd_timer;
+	DSRUUTimer rreq_coalesce_timer;
 	DSRUUTimer send_buf_timer;
+	DSRUUTimer repair_timer;
+	DSRUUTimer rerr_tbl_timer;
 	DSRUUTimer neigh_tbl_timer;
 	DSRUUTimer lc_timer;
 
@@ -186,6 +186,29 @@ int NSCLASS send_buf_enqueue_packet(struct dsr_pkt *dp, xmit_fct_t okfn)
 	return res;
 }
 
+/* Detach the oldest packet buffered for dst, but only if its payload is at
+ * most max_len bytes. Used to piggyback data on a route request. */
+struct dsr_pkt *NSCLASS send_buf_dequeue_first(struct in_addr dst,
+					       int max_len)
+{
+	struct send_buf_entry *e;
+	struct dsr_pkt *dp = NULL;
+
+	write_lock_bh(&send_buf.lock);
+
+	e = (struct send_buf_entry *)__tbl_find(&send_buf, &dst, crit_addr);
+
+	if (e && e->dp->payload_len <= max_len) {
+		__tbl_detach(&send_buf, &e->l);
+		dp = e->dp;
+		kfree(e);
+	}
+
+	write_unlock_bh(&send_buf.lock);
+
+	return dp;
+}
+
 int NSCLASS send_buf_set_verdict(int verdict, struct in_addr dst)
 {
 	struct send_buf_entry *e;
@@ -30,6 +30,7 @@ void send_buf_set_max_len(unsigned int max_len);
 int send_buf_find(struct in_addr dst);
 int send_buf_enqueue_packet(struct dsr_pkt *dp, xmit_fct_t okfn);
 int send_buf_set_verdict(int verdict, struct in_addr dst);
+struct dsr_pkt *send_buf_dequeue_first(struct in_addr dst, int max_len);
 int send_buf_init(void);
 void send_buf_cleanup(void);
 void send_buf_timeout(unsigned long data);
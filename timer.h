@@ -23,6 +23,7 @@ typedef unsigned long usecs_t;
 #include <agent.h>
 #include <trace.h>
 #include <scheduler.h>
+#include <tools/random.h>
 
 class DSRUU;
 
@@ -69,9 +70,16 @@ static inline void gettime(struct timeval *tv)
 	tv->tv_usec = (long)usecs;
 }
 
+/* Random delay, uniformly distributed in [0, max) */
+static inline usecs_t random_jitter(usecs_t max)
+{
+	return (usecs_t)(Random::uniform() * max);
+}
+
 #else
 
 #include <linux/timer.h>
+#include <linux/random.h>
 
 typedef struct timer_list DSRUUTimer;
 
@@ -109,6 +117,19 @@ static inline void gettime(struct timeval *tv)
 	tv->tv_usec = (now % HZ) * 1000000l / HZ;
 #endif
 }
+
+/* Random delay, uniformly distributed in [0, max) */
+static inline usecs_t random_jitter(usecs_t max)
+{
+	unsigned int r;
+
+	if (max == 0)
+		return 0;
+
+	get_random_bytes(&r, sizeof(r));
+
+	return r % max;
+}
 #endif				/* NS2 */
 
 static inline char *print_timeval(struct timeval *tv)